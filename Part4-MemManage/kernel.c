@@ -1,4 +1,36 @@
+#ifdef KRNL_HOSTED
+/* The "hosted" build: the console and memory manager compiled as a normal Linux program, so they can be tried out and
+   timed without booting anything (the benchmarks are right at the bottom of the file). Build it with
+       gcc -DKRNL_HOSTED -O2 -o kbench kernel.c
+   (as a 32 or a 64 bit program, the memory manager keeps addresses in size_t). Our malloc, puts and friends would clash
+   with the C library's - and the C library would start using our malloc! - so here they get other names. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#define strcmp kstrcmp
+#define strncmp kstrncmp
+#define strlen kstrlen
+#define memchr kmemchr
+#define memcpy kmemcpy
+#define memmove kmemmove
+#define memset kmemset
+#define atoi katoi
+#define puts kputs
+#define malloc kmalloc
+#define free kfree
+#define realloc krealloc
+#define calloc kcalloc
+#define aligned_alloc kaligned_alloc
+#define memalign kmemalign
+#endif
+
+typedef unsigned long long uint64_t;
 typedef unsigned int uint32_t; // We don't have std libraries (bare-metal env)
+typedef int int32_t;
 typedef unsigned short uint16_t;
 typedef unsigned char uint8_t;
 typedef unsigned long size_t;
@@ -7,26 +39,114 @@ typedef unsigned long size_t;
 #define VGAWID 80 // VGA width (column)
 #define VGAHI 25 // VGA height (row)
 #define VGAMEM 0xB8000 // This is where VGA text mode is in the computer memory. For graphics, you will want to use
-// the frame buffer (0xA0000 if I remember right!)
+// the frame buffer (0xA0000 if I remember right!) - and we do, see the graphics mode bit after part two.
+#define GFXMEM 0xA0000 // (it was right) the mode 13h frame buffer: 320x200 pixels, one byte (a colour number) each
+#define GFXWID 320
+#define GFXHI 200
+#define GFXCOLS (GFXWID / 8) // with an 8x8 font that's 40 columns of text, and 200 / 8 = 25 rows, same as VGAHI
+
+#define VGAROWS 204 // How many 80 column rows fit into the 32K of text memory (0xB8000 - 0xBFFFF). We use the spare rows to scroll.
+#define NCONSOLES 4 // How many virtual consoles we have (Alt+F1 to Alt+F4 switches between them)
+#define CONROWS (VGAROWS / NCONSOLES) // Each console gets its own slice of VGA memory, 51 rows each
+#define SCROLLBACK 1024 // How many lines of old output each console keeps around in normal RAM (Shift+PgUp/PgDn to look at them)
 
 #define MAXBUFSZ 128 // Max buffer size (for readstr)
 
+#ifndef NULL
 #define NULL 0
+#endif
 
 
+#ifdef KRNL_HOSTED
+static uint16_t fakevga[VGAROWS * VGAWID]; // (no VGA card in the hosted build, so its "memory" is just an array)
+static uint16_t* vmem = fakevga;
+#else
 static uint16_t* vmem = (uint16_t*)VGAMEM; // This part is interesting. It establishes a 16 bit pointer to VGA, so VGA acts as a 16 bit value
-static size_t cursorx = 0; // This is useful for I/O. Now, cursor is referring to the text cursor (google it), not the mouse cursor!
-static size_t cursory = 0;
-static uint8_t VGCOL = 0x9B; // This makes an 8-bit value that represents the color of VGA characters.
+#endif
+static uint8_t VGCOL = 0x9B; // This makes an 8-bit value that represents the color of VGA characters. (every console starts with it)
 /* 
 The reason it is 8-bit is because VGA requires 2 values: color and the character. VGA, here, is 16-bit. Meaning we need
 2 8-bit values to go inside of a 16-bit array. One 16 bit value in VGA is an index, because VGA is an array of characters.
 */
 
+#define ALLDIRTY ((1u << VGAHI) - 1) // every row of the screen needs redrawing (see flush())
+
+/* A virtual console is everything one "screen" needs to remember. We keep a few of them, and only one is on the screen
+   at a time (the foreground one). Output can still go to the others, it just doesn't show until you switch to them. */
+typedef struct console {
+    /* The scrollback ring. Every line we print lives in here first, and the screen is just a 25 line window into it.
+       sbtop is the ring line that is currently the top row of the screen, so scrolling is just sbtop++ (no copying!) */
+    uint16_t scrollback[SCROLLBACK][VGAWID];
+    size_t sbtop; // ring line shown on screen row 0
+    size_t sblines; // how many ring lines actually hold output (so we don't scroll back into nothing)
+    size_t sbview; // how many lines the user has scrolled back (0 means we're looking at live output)
+
+    size_t cursorx; // This is useful for I/O. Now, cursor is referring to the text cursor (google it), not the mouse cursor!
+    size_t cursory;
+    uint8_t color; // the VGCOL of this console
+
+    size_t vgabase; // first row of VGA memory that belongs to this console
+    size_t vgatop; // which row of its slice the screen currently starts at
+    uint32_t vgadirty; // bit y set = screen row y has to be copied to VGA memory
+
+    char line[MAXBUFSZ]; // what's been typed on this console so far (it sticks around while you're on another console)
+    size_t linepos;
+} console_t;
+
+static console_t consoles[NCONSOLES];
+static console_t* con = &consoles[0]; // the console that output goes to
+static console_t* fgcon = &consoles[0]; // the console that's on the screen (and gets the keyboard)
+static int gfxmode = 0; // are we drawing text ourselves in graphics mode instead of letting VGA text mode do it?
+static size_t concols = VGAWID; // how many columns of text fit on the screen (fewer in graphics mode)
+
+/* The event tracer (it lives at the bottom, next to the profiler) gets called from all over, so here's what it records */
+enum {
+    TR_BOOT, // a boot step finished (a = which one, see the BOOT_ list)
+    TR_KEY, // a scancode came in (a = scancode)
+    TR_CMD, // a command started (a = its first 4 letters, b = its length)
+    TR_CMDDONE, // ...and finished
+    TR_MALLOC, // a = size asked for, b = what malloc gave back
+    TR_FREE, // a = what got freed
+    TR_NEVENTS
+};
+enum { BOOT_START, BOOT_INT, BOOT_TIMER, BOOT_MEM, BOOT_SMP, BOOT_CONSOLES, BOOT_NSTEPS };
+static void trace(uint32_t id, uint32_t a, uint32_t b);
+static volatile int traceon = 1; // (the smpbench turns it off for a bit)
+
 
 // Now we'll need to lay a foundation for what is to come (string comparing, char to int)
 
+/* These go through strings a whole word at a time (4 bytes, or 8 in a 64 bit build) instead of a byte at a time.
+   The trick is finding a 0 byte in a word without looking at each byte: (x - 0x01010101) & ~x & 0x80808080 is only
+   nonzero if some byte of x is 0. (Subtracting 1 from a 0 byte borrows and sets its top bit; "& ~x" throws away bytes
+   whose top bit was set to begin with.) To find a byte c instead, look for a 0 in x ^ (c repeated 4 times).
+
+   The word reads are always aligned, so a word never hangs over the end of a page: if the string's last byte is
+   readable, so is the rest of its word. The unaligned bytes at the start are done one at a time. */
+typedef size_t __attribute__((may_alias)) word_t; // (may_alias: it's ok to read chars through it)
+#define ONES ((word_t)-1 / 0xFF) // 0x01 in every byte
+#define HIGHS (ONES * 0x80) // 0x80 in every byte
+#define HASZERO(x) (((x) - ONES) & ~(x) & HIGHS)
+#define WORDALIGNED(p) (((size_t)(p) & (sizeof(word_t) - 1)) == 0)
+
 int strcmp(const char *s1, const char *s2) {
+    if (WORDALIGNED((size_t)s1 ^ (size_t)s2)) { // same place in a word, so once one's aligned so is the other
+        while (!WORDALIGNED(s1)) {
+            if (!*s1 || *s1 != *s2) {
+                return *(const unsigned char*)s1 - *(const unsigned char*)s2;
+            }
+            s1++;
+            s2++;
+        }
+        const word_t* w1 = (const word_t*)s1;
+        const word_t* w2 = (const word_t*)s2;
+        while (*w1 == *w2 && !HASZERO(*w1)) { // (equal, so if one has no 0 neither has the other)
+            w1++;
+            w2++;
+        }
+        s1 = (const char*)w1; // the difference or the end is in this word, the byte loop finds it
+        s2 = (const char*)w2;
+    }
     while(*s1 && (*s1 == *s2)) {
         s1++;
         s2++;
@@ -36,6 +156,25 @@ int strcmp(const char *s1, const char *s2) {
 
 /* strncmp: Compares up to n characters of two strings. */
 int strncmp(const char *s1, const char *s2, size_t n) {
+    if (WORDALIGNED((size_t)s1 ^ (size_t)s2)) {
+        while (n && !WORDALIGNED(s1)) {
+            if (!*s1 || *s1 != *s2) {
+                return *(const unsigned char*)s1 - *(const unsigned char*)s2;
+            }
+            s1++;
+            s2++;
+            n--;
+        }
+        const word_t* w1 = (const word_t*)s1;
+        const word_t* w2 = (const word_t*)s2;
+        while (n >= sizeof(word_t) && *w1 == *w2 && !HASZERO(*w1)) {
+            w1++;
+            w2++;
+            n -= sizeof(word_t);
+        }
+        s1 = (const char*)w1;
+        s2 = (const char*)w2;
+    }
     while(n && *s1 && (*s1 == *s2)) {
         s1++;
         s2++;
@@ -46,6 +185,219 @@ int strncmp(const char *s1, const char *s2, size_t n) {
     return *(const unsigned char*)s1 - *(const unsigned char*)s2;
 }
 
+/* strlen: counts the characters before the '\0' at the end of a string. */
+size_t strlen(const char *s) {
+    const char *p = s;
+    while (!WORDALIGNED(p)) {
+        if (!*p) {
+            return p - s;
+        }
+        p++;
+    }
+    const word_t* w = (const word_t*)p;
+    while (!HASZERO(*w)) {
+        w++;
+    }
+    p = (const char*)w;
+    while(*p)
+        p++;
+    return p - s;
+}
+
+/* memchr: finds the first c in the n bytes at s (NULL if there isn't one). */
+void* memchr(const void* s, int c, size_t n) {
+    const unsigned char* p = s;
+    while (n && !WORDALIGNED(p)) {
+        if (*p == (unsigned char)c) {
+            return (void*)p;
+        }
+        p++;
+        n--;
+    }
+    const word_t* w = (const word_t*)p;
+    word_t cc = ONES * (unsigned char)c;
+    while (n >= sizeof(word_t) && !HASZERO(*w ^ cc)) {
+        w++;
+        n -= sizeof(word_t);
+    }
+    for (p = (const unsigned char*)w; n; p++, n--) {
+        if (*p == (unsigned char)c) {
+            return (void*)p;
+        }
+    }
+    return NULL;
+}
+
+/* Copying and filling memory. Clearing the screen, scrolling, copying to VGA and the heap all come down to these, so
+   they pick the fastest way they can for the size:
+   - under 16 bytes, a plain loop (anything fancier costs more to set up than it saves)
+   - "rep movsb" / "rep stosb" for big ones, on CPUs that say they're good at it ("ERMS", enhanced rep movsb): the
+     CPU does it in whole cache lines by itself
+   - everything else 16 bytes at a time through the SSE registers: the first and last 16 bytes with unaligned moves
+     (which may overlap the middle, that's fine), and aligned moves in between, 64 bytes a go.
+   The SSE registers have to be switched on first, and saved by the interrupt stubs (see sseinit).
+
+   gcc also calls memcpy and memset by itself (for big struct copies, or a loop it recognises), so they have to be
+   here with exactly these names. NOLIBCALL stops it turning the loops in here into calls to themselves. */
+#define SMALLCOPY 16
+#define ERMSCOPY 512 // rep movsb is quicker than SSE from about here up
+#define NOLIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+#ifdef __SSE__
+#define XMMREGS , "xmm0", "xmm1", "xmm2", "xmm3" // (gcc only knows about them in builds that use them itself)
+#else
+#define XMMREGS
+#endif
+
+static int cpusse __attribute__((used)) = 0; // set up by sseinit (the interrupt stubs look at it too)
+static int cpuerms = 0;
+
+static inline void cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ __volatile__ ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static void ssecopy(uint8_t* d, const uint8_t* s, size_t n) { // (n >= 16)
+    uint8_t* dend = d + n - 16;
+    const uint8_t* send = s + n - 16;
+    __asm__ __volatile__ ("movups (%0), %%xmm0\n movups %%xmm0, (%1)" : : "r"(s), "r"(d) : "memory" XMMREGS);
+    size_t skip = 16 - ((size_t)d & 15); // up to where d is 16 byte aligned
+    d += skip;
+    s += skip;
+    n -= skip;
+    for (; n >= 64; d += 64, s += 64, n -= 64) {
+        __asm__ __volatile__ (
+            "movups (%0), %%xmm0\n movups 16(%0), %%xmm1\n movups 32(%0), %%xmm2\n movups 48(%0), %%xmm3\n"
+            "movaps %%xmm0, (%1)\n movaps %%xmm1, 16(%1)\n movaps %%xmm2, 32(%1)\n movaps %%xmm3, 48(%1)"
+            : : "r"(s), "r"(d) : "memory" XMMREGS);
+    }
+    for (; n >= 16; d += 16, s += 16, n -= 16) {
+        __asm__ __volatile__ ("movups (%0), %%xmm0\n movaps %%xmm0, (%1)" : : "r"(s), "r"(d) : "memory" XMMREGS);
+    }
+    __asm__ __volatile__ ("movups (%0), %%xmm0\n movups %%xmm0, (%1)" : : "r"(send), "r"(dend) : "memory" XMMREGS);
+}
+
+void* NOLIBCALL memcpy(void* dst, const void* src, size_t n) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    if (n < SMALLCOPY) {
+        while (n--) {
+            *d++ = *s++;
+        }
+    } else if (cpusse && !(cpuerms && n >= ERMSCOPY)) {
+        ssecopy(d, s, n);
+    } else if (cpuerms) {
+        __asm__ __volatile__ ("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+    } else { // (an old CPU: 4 bytes at a time is still better than 1)
+        size_t rest = n & 3;
+        n /= 4;
+        __asm__ __volatile__ ("rep movsl\n mov %3, %2\n rep movsb" : "+D"(d), "+S"(s), "+c"(n) : "r"(rest) : "memory");
+    }
+    return dst;
+}
+
+void* NOLIBCALL memmove(void* dst, const void* src, size_t n) { // memcpy, but dst and src are allowed to overlap
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    if (d + n <= s || s + n <= d) { // (they don't, which is nearly always)
+        return memcpy(dst, src, n);
+    }
+    if (d < s) { // copying forwards is fine as long as we write each byte after reading it
+        __asm__ __volatile__ ("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+    } else { // otherwise backwards, from the last byte down (std makes rep go that way)
+        d += n - 1;
+        s += n - 1;
+        __asm__ __volatile__ ("std\n rep movsb\n cld" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+    }
+    return dst;
+}
+
+/* Fills n bytes with a 4 byte pattern (low byte first). Wherever it starts a store, the pattern has to come out the
+   same, so it's either one byte 4 times (memset) or a 2 byte value twice at an even address (memsetw) */
+static void NOLIBCALL fill(uint8_t* d, uint32_t pattern, size_t n) {
+    if (n < SMALLCOPY) {
+        for (size_t i = 0; i < n; i++) {
+            d[i] = (uint8_t)(pattern >> (i % 4 * 8));
+        }
+    } else if (cpusse && !(cpuerms && n >= ERMSCOPY && pattern == (pattern & 0xFF) * 0x01010101u)) {
+        uint32_t pat[4] = { pattern, pattern, pattern, pattern };
+        uint8_t* end = d + n - 16;
+        n -= 16 - ((size_t)d & 15);
+        size_t blocks = n / 16; // whole aligned 16 byte blocks after the first (unaligned) store
+        /* All in one asm statement: the compiler doesn't know xmm0 holds the pattern, so it's free to use xmm0 for
+           something else between two separate ones. So the first store, the loops and the last store all go together */
+        __asm__ __volatile__ (
+            "movups (%[pat]), %%xmm0\n"
+            " movups %%xmm0, (%[d])\n" // the first 16 bytes, wherever they start
+            " add $16, %[d]\n"
+            " and $-16, %[d]\n" // up to the next 16 byte boundary (the bytes we skipped are done already)
+            "1: cmp $4, %[blocks]\n"
+            " jb 2f\n"
+            " movaps %%xmm0, (%[d])\n"
+            " movaps %%xmm0, 16(%[d])\n"
+            " movaps %%xmm0, 32(%[d])\n"
+            " movaps %%xmm0, 48(%[d])\n"
+            " add $64, %[d]\n"
+            " sub $4, %[blocks]\n"
+            " jmp 1b\n"
+            "2: test %[blocks], %[blocks]\n"
+            " jz 3f\n"
+            " movaps %%xmm0, (%[d])\n"
+            " add $16, %[d]\n"
+            " dec %[blocks]\n"
+            " jmp 2b\n"
+            "3: movups %%xmm0, (%[end])" // and the last 16 bytes, which might overlap the ones before
+            : [d] "+r"(d), [blocks] "+r"(blocks)
+            : [pat] "r"(pat), [end] "r"(end)
+            : "memory", "cc" XMMREGS);
+    } else if (cpuerms && pattern == (pattern & 0xFF) * 0x01010101u) {
+        __asm__ __volatile__ ("rep stosb" : "+D"(d), "+c"(n) : "a"(pattern) : "memory");
+    } else {
+        size_t rest = n & 3;
+        n /= 4;
+        __asm__ __volatile__ ("rep stosl" : "+D"(d), "+c"(n) : "a"(pattern) : "memory");
+        for (size_t i = 0; i < rest; i++) {
+            d[i] = (uint8_t)(pattern >> (i * 8));
+        }
+    }
+}
+
+void* memset(void* dst, int c, size_t n) {
+    fill(dst, (uint8_t)c * 0x01010101u, n);
+    return dst;
+}
+
+void* memsetw(uint16_t* dst, uint16_t v, size_t count) { // memset for 16 bit values, like VGA cells
+    fill((uint8_t*)dst, v * 0x00010001u, count * 2);
+    return dst;
+}
+
+/* SSE is off when the CPU starts (using its registers is an "invalid opcode"), so every CPU turns it on for itself.
+   Once it's on, the interrupt stubs save the SSE registers too: the code that got interrupted might have been halfway
+   through a memcpy, and the handler might do a memcpy of its own. */
+void sseinit() {
+    uint32_t a, b, c, d;
+    cpuid(0, &a, &b, &c, &d);
+    uint32_t maxleaf = a;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & (1 << 25)) || !(d & (1 << 24))) { // no SSE, or no fxsave to save its registers with
+        return;
+    }
+    if (maxleaf >= 7) {
+        cpuid(7, &a, &b, &c, &d);
+        cpuerms = (b >> 9) & 1;
+    }
+#ifndef KRNL_HOSTED
+    uint32_t cr;
+    __asm__ __volatile__ ("mov %%cr0, %0" : "=r"(cr));
+    cr &= ~0x0Cu; // no EM (FPU emulation) and no TS (task switched), or SSE instructions fault
+    cr |= 0x02; // MP
+    __asm__ __volatile__ ("mov %0, %%cr0" : : "r"(cr));
+    __asm__ __volatile__ ("mov %%cr4, %0" : "=r"(cr));
+    cr |= 0x600; // OSFXSR (we save the SSE registers with fxsave) and OSXMMEXCPT (we handle SSE exceptions... well)
+    __asm__ __volatile__ ("mov %0, %%cr4" : : "r"(cr));
+#endif
+    cpusse = 1;
+}
+
 /* A simple atoi: converts a string of digits into an integer.
    Only handles positive numbers. */
 int atoi(const char *s) {
@@ -60,69 +412,449 @@ int atoi(const char *s) {
 
 /* Now we can get to the juicy bits - what you came here for!*/
 
-void putchr(char c) {
-    if (c == '\n') { // Checks if the character in the register (C is made in Assembly) is new line (\n)
-        cursorx = 0; // Reset the cursor's x position to the far left of the screen
-        if (++cursory >= VGAHI) { // checks if wheen y is increased, it exceeds or is equal to VGA height
-            cursory = VGAHI - 1;
+/* To talk to the VGA card itself (not its memory) we have to write to I/O ports. We'll meet outb's sibling, inb, in part two. */
+static inline void outb(uint16_t port, uint8_t val) {
+#ifdef KRNL_HOSTED
+    (void)port; // (a normal program isn't allowed near the ports)
+    (void)val;
+#else
+    __asm__ __volatile__ ("outb %0, %1" : : "a"(val), "Nd"(port));
+#endif
+}
+
+/* The CRTC (the bit of VGA that scans memory onto the screen) has a "start address" register.
+   Changing it makes the screen start somewhere else in VGA memory - a scroll (or a whole console switch!) that costs 2 port writes. */
+static void vgastart(size_t pos) {
+    outb(0x3D4, 0x0C); // start address high byte
+    outb(0x3D5, (uint8_t)(pos >> 8));
+    outb(0x3D4, 0x0D); // start address low byte
+    outb(0x3D5, (uint8_t)(pos & 0xFF));
+}
+
+static void vgacursor(size_t pos) { // same idea for the blinking hardware cursor
+    outb(0x3D4, 0x0E); // cursor location high byte
+    outb(0x3D5, (uint8_t)(pos >> 8));
+    outb(0x3D4, 0x0F); // cursor location low byte
+    outb(0x3D5, (uint8_t)(pos & 0xFF));
+}
+
+static uint16_t* sbline(size_t row) { // gets the ring line for a screen row
+    return con->scrollback[(con->sbtop + row) % SCROLLBACK];
+}
+
+/* Here's a catch: VGA memory isn't normal memory. Every write to it goes out to the video card (and in a VM, every
+   write can make the emulator step in), so it's WAY slower than writing to RAM. So putchr never touches VGA memory!
+   It only writes into the scrollback ring (which is normal RAM) and marks the screen row as "dirty".
+   flush() then copies just the dirty rows to VGA in one go. One bit per row, 25 rows, fits in one number. */
+static size_t vgashown = (size_t)-1; // the start address the CRTC actually has right now
+static size_t cursorshown = (size_t)-1; // and where the hardware cursor actually is
+
+static void gfxflush(console_t* c); // the graphics mode version, it lives after part two
+
+static void conflush(console_t* c) {
+    if (gfxmode) { // in graphics mode there's no text memory, and only the foreground console gets drawn
+        if (c == fgcon) {
+            gfxflush(c);
+        }
+        c->vgadirty = 0;
+        return;
+    }
+
+    if (c->vgadirty) {
+        size_t first = c->sbtop + SCROLLBACK - c->sbview; // ring line at the top of what we're looking at
+        for (size_t y = 0; y < VGAHI; y++) {
+            if (!(c->vgadirty & (1u << y))) {
+                continue;
+            }
+            /* One memcpy per row, so a row is 10 16 byte writes to VGA instead of 80 2 byte ones.
+               Consoles in the background get flushed too, into their own slice of VGA memory, so switching is free */
+            memcpy(vmem + (c->vgabase + c->vgatop + y) * VGAWID, c->scrollback[(first + y) % SCROLLBACK],
+                   VGAWID * sizeof(uint16_t));
         }
+        c->vgadirty = 0;
+    }
 
+    if (c != fgcon) {
         return;
     }
-    size_t index = cursory * VGAWID + cursorx;
-    vmem[index] = (uint16_t)c | (VGCOL << 8);
-    /* Ok, that may be a lot to sink in — stay with me!  
-   Remember how VGA text mode uses an array to store characters?  
-   Unfortunately, we can’t just tell the computer "put this character at (x, y)."  
-   Instead, we have to calculate the correct position in memory.  
+    /* Only poke the CRTC when something actually moved, and only once per flush no matter how many lines we printed */
+    size_t start = (c->vgabase + c->vgatop) * VGAWID;
+    if (vgashown != start) {
+        vgastart(start);
+        vgashown = start;
+    }
+    size_t cursor = start + c->cursory * VGAWID + c->cursorx;
+    if (cursorshown != cursor) {
+        vgacursor(cursor);
+        cursorshown = cursor;
+    }
+}
 
-   The formula for finding the index (position in the array) is:  
-        (row * screen width) + column  
+void flush() {
+    conflush(con);
+}
 
-   Now for the second part:  
-   - (uint16_t)c tells the computer to store the character as a **16-bit** value.  
-   - (VGCOL << 8) shifts the color into the upper (high) byte.  
-   - The bitwise OR (|) combines them into a single value, like this:  
-        [ COLOR (high byte) | CHARACTER (low byte) ]  
+static void gfxredraw(); // (graphics mode again)
 
-   And that’s how we write text with color in VGA mode!
-*/
+static void conswitch(size_t n) { // brings console n to the front. No copying at all, the CRTC just looks somewhere else
+    fgcon = &consoles[n];
+    if (gfxmode) { // ...except in graphics mode, where there's only one screen to draw everything on
+        gfxredraw();
+    }
+    conflush(fgcon);
+}
+
+static void sbscroll(int lines) { // moves the view of the foreground console back (positive) or forward (negative) through old output
+    console_t* c = fgcon;
+    size_t max = (c->sblines > VGAHI) ? c->sblines - VGAHI : 0;
+    if (lines < 0) {
+        c->sbview = ((size_t)-lines > c->sbview) ? 0 : c->sbview - (size_t)-lines;
+    } else {
+        c->sbview = (c->sbview + (size_t)lines > max) ? max : c->sbview + (size_t)lines;
+    }
+    c->vgadirty = ALLDIRTY;
+    conflush(c);
+}
+
+static void scroll() {
+    uint16_t blank = (uint16_t)' ' | (con->color << 8);
+
+    con->sbtop = (con->sbtop + 1) % SCROLLBACK; // the actual scroll! the old top line is now history
+    if (con->sblines < SCROLLBACK) {
+        con->sblines++;
+    }
+    memsetw(sbline(VGAHI - 1), blank, VGAWID); // the ring line we just reused still has really old output in it
+
+    /* Same trick for VGA memory: show the screen one row further down. Rows that were already flushed are in the right
+       place now, so the dirty bits just move up a row with them. When we hit the end of the console's slice of VGA memory
+       we have to redraw the whole screen at the top of it, but that's once every ~26 lines instead of every line. */
+    if (con->vgatop + VGAHI >= CONROWS) {
+        con->vgatop = 0;
+        con->vgadirty = ALLDIRTY;
+    } else {
+        con->vgatop++;
+        con->vgadirty = (con->vgadirty >> 1) | (1u << (VGAHI - 1));
+    }
+}
+
+static void newline() {
+    con->cursorx = 0; // Reset the cursor's x position to the far left of the screen
+    if (++con->cursory >= VGAHI) { // checks if wheen y is increased, it exceeds or is equal to VGA height
+        con->cursory = VGAHI - 1;
+        scroll(); // no more room, so move everything up a line
+    }
+}
+
+/* console_write prints n characters. Printing them one at a time would redo all the checks for every single character,
+   so instead we grab as many characters as fit on the current row (stopping early at a \n or \b) and copy that whole
+   run in one tight loop. A long string costs about one loop setup per row instead of per character. */
+static void serialwrite(const char* str, size_t n); // (the serial port, in part two)
+
+void console_write(const char* str, size_t n) {
+    if (con == fgcon) { // whatever's on the screen goes out the serial port too
+        serialwrite(str, n);
+    }
+    if (con->sbview) { // if the user was looking at old output, jump back to the live screen first
+        con->sbview = 0;
+        con->vgadirty = ALLDIRTY;
+    }
+
+    uint16_t attr = (uint16_t)(con->color << 8); // the colour half of every cell is the same, so work it out once
+    while (n) {
+        if (*str == '\n') { // Checks if the character in the register (C is made in Assembly) is new line (\n)
+            newline();
+            str++;
+            n--;
+            continue;
+        }
+        if (*str == '\b') { // backspace just moves the cursor back a spot (readstr rubs the character out)
+            if (con->cursorx > 0) {
+                con->cursorx--;
+            } else if (con->cursory > 0) {
+                con->cursorx = concols - 1;
+                con->cursory--;
+            }
+            str++;
+            n--;
+            continue;
+        }
+
+        /* Everything else gets copied a run at a time: as many plain characters as fit on the rest of this row,
+           stopping early at a \n or \b (the top of the loop deals with those).
+
+           Remember how VGA text mode uses an array to store characters? Each cell is 16 bits:
+                [ COLOR (high byte) | CHARACTER (low byte) ]
+           which is why every character gets OR'd with attr (the colour, already shifted up 8). And to find a cell
+           you'd normally do (row * screen width) + column, but sbline() does the row part for us, since the screen
+           might be anywhere in the scrollback ring, and then we just add the column to get dst. */
+        size_t run = concols - con->cursorx; // how much room is left on this row
+        if (run > n) {
+            run = n;
+        }
+        uint16_t* dst = sbline(con->cursory) + con->cursorx; // goes into the ring (RAM), flush() gets it to the screen later
+        size_t i = 0;
+        while (i < run && str[i] != '\n' && str[i] != '\b') {
+            dst[i] = (uint16_t)(uint8_t)str[i] | attr;
+            i++;
+        }
+        con->vgadirty |= 1u << con->cursory;
+        con->cursorx += i;
+        str += i;
+        n -= i;
+
+        if (con->cursorx >= concols) { // ran off the end of the row, so wrap around to the next one
+            newline();
+        }
+    }
+}
+
+void putchr(char c) {
+    console_write(&c, 1);
+}
+
+
+void puts(const char* str) { // prints a whole string in one go, then puts it on the screen
+    console_write(str, strlen(str));
+    flush(); // and now the whole string goes to the screen at once
+}
+
+/* puts only does strings, so here's a way to print numbers too: peel digits off the bottom into a little buffer
+   (which fills up backwards), then print the buffer. Dividing is slow though (dozens of cycles, even when the
+   compiler turns "/ 100" into a multiply it's still a few), so we peel off two digits at a time and look the pair up
+   in a table: "00" "01" ... "99". Half the divides. */
+static const char digitpairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static char* fmtdec(char* end, unsigned long n) { // writes n's digits so they end at end, returns where they start
+    while (n >= 100) {
+        unsigned long q = n / 100;
+        const char* pair = &digitpairs[(n - q * 100) * 2];
+        end -= 2;
+        end[0] = pair[0];
+        end[1] = pair[1];
+        n = q;
+    }
+    if (n >= 10) {
+        end -= 2;
+        end[0] = digitpairs[n * 2];
+        end[1] = digitpairs[n * 2 + 1];
+    } else {
+        *--end = (char)('0' + n);
+    }
+    return end;
+}
+
+static char* fmthex(char* end, unsigned long n, size_t mindigits, int upper) { // (no dividing in hex, just shifts)
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    size_t i = 0;
+    do {
+        *--end = digits[n & 0xF];
+        n >>= 4;
+        i++;
+    } while (n || i < mindigits);
+    return end;
+}
+
+/* And the real thing: kprintf("%u free of %u\n", a, b). It understands %d %u %x %X %p %s %c and %%, with a width
+   ("%8u"), which can pad with 0s ("%08x") or on the right ("%-10s"). l and z (for longs and size_t) are allowed.
+   Anything else after a % is printed just as it was written ("%q" prints "%q").
+
+   Nothing gets malloc'd (you might be printing *why* malloc failed). The text is put together in a buffer on the
+   stack and handed to console_write in one go; only if it doesn't fit does it go out in buffer-sized pieces. */
+#define KPRINTFBUF 256
+
+typedef struct fmtout {
+    char* buf;
+    size_t size; // how much fits in buf
+    size_t len; // how much is in it
+    size_t total; // how much we were asked to write (it might not all fit, for ksnprintf)
+    int console; // a full buf goes to the console and starts again (kprintf), or the rest is cut off (ksnprintf)
+} fmtout_t;
 
-    if (++cursorx >= VGAWID) {
-        cursorx = 0;
-        if (++cursory >= VGAHI) {
-            cursory = VGAHI - 1;
+static void fmtput(fmtout_t* o, const char* s, size_t n) {
+    o->total += n;
+    while (n) {
+        if (o->len == o->size) {
+            if (!o->console) {
+                return;
+            }
+            console_write(o->buf, o->len);
+            o->len = 0;
         }
+        size_t chunk = o->size - o->len < n ? o->size - o->len : n;
+        memcpy(o->buf + o->len, s, chunk);
+        o->len += chunk;
+        s += chunk;
+        n -= chunk;
     }
+}
 
+static void fmtpad(fmtout_t* o, char c, size_t n) {
+    static const char spaces[16] = "                ", zeros[16] = "0000000000000000";
+    while (n) {
+        size_t chunk = n < 16 ? n : 16;
+        fmtput(o, c == '0' ? zeros : spaces, chunk);
+        n -= chunk;
+    }
 }
 
+static void kvformat(fmtout_t* o, const char* fmt, __builtin_va_list ap) {
+    while (*fmt) {
+        const char* run = fmt; // everything up to the next % goes in as it is, in one piece
+        while (*fmt && *fmt != '%') {
+            fmt++;
+        }
+        fmtput(o, run, fmt - run);
+        if (!*fmt) {
+            break;
+        }
+        const char* spec = fmt++; // (the %, for a directive we can't do anything with)
+
+        int left = 0, islong = 0;
+        char pad = ' ';
+        for (;; fmt++) {
+            if (*fmt == '-') {
+                left = 1;
+            } else if (*fmt == '0') {
+                pad = '0';
+            } else {
+                break;
+            }
+        }
+        size_t width = 0;
+        while (*fmt >= '0' && *fmt <= '9') {
+            width = width * 10 + (size_t)(*fmt++ - '0');
+        }
+        while (*fmt == 'l' || *fmt == 'z') { // (on our 32 bit kernel these are all the same size as int anyway)
+            islong = 1;
+            fmt++;
+        }
+
+        char tmp[2 + sizeof(long) * 3]; // room for the longest number (3 digits per byte is plenty, and "0x")
+        char* end = tmp + sizeof(tmp);
+        const char* p = end;
+        int neg = 0;
+        switch (*fmt) {
+        case 'd': {
+            long v = islong ? __builtin_va_arg(ap, long) : __builtin_va_arg(ap, int);
+            neg = v < 0;
+            p = fmtdec(end, neg ? -(unsigned long)v : (unsigned long)v);
+            break;
+        }
+        case 'u':
+            p = fmtdec(end, islong ? __builtin_va_arg(ap, unsigned long) : __builtin_va_arg(ap, unsigned int));
+            break;
+        case 'x':
+        case 'X':
+            p = fmthex(end, islong ? __builtin_va_arg(ap, unsigned long) : __builtin_va_arg(ap, unsigned int), 1,
+                       *fmt == 'X');
+            break;
+        case 'p': { // (always all the digits, with 0x in front)
+            char* q = fmthex(end, (unsigned long)__builtin_va_arg(ap, void*), sizeof(void*) * 2, 1);
+            *--q = 'x';
+            *--q = '0';
+            p = q;
+            break;
+        }
+        case 's':
+            p = __builtin_va_arg(ap, const char*);
+            if (!p) {
+                p = "(null)";
+            }
+            end = (char*)p + strlen(p);
+            break;
+        case 'c':
+            tmp[0] = (char)__builtin_va_arg(ap, int);
+            p = tmp;
+            end = tmp + 1;
+            break;
+        case '%':
+            p = fmt;
+            end = (char*)fmt + 1;
+            break;
+        case '\0': // (a % at the very end)
+            fmt--;
+            // fall through
+        default: // anything we don't know comes out as it is, % and all
+            p = spec;
+            end = (char*)fmt + 1;
+            width = 0;
+            break;
+        }
+        fmt++;
+
+        size_t len = (size_t)(end - p) + neg;
+        size_t fill = width > len ? width - len : 0;
+        if (!left && pad == ' ') {
+            fmtpad(o, ' ', fill);
+        }
+        if (neg) {
+            fmtput(o, "-", 1); // (the - goes before any 0s)
+        }
+        if (!left && pad == '0') {
+            fmtpad(o, '0', fill);
+        }
+        fmtput(o, p, (size_t)(end - p));
+        if (left) {
+            fmtpad(o, ' ', fill);
+        }
+    }
+}
 
-void puts(const char* str) { // this is a loop to check if str exists, then print it to VGA and move to the next char
-    while (*str) { // while the string exists:
-        putchr(*str++); // put the character, then add another until the string DOESN'T exist (checked by the while loop)
+/* Like snprintf: writes at most size - 1 characters and a '\0' to buf, and returns how long the whole thing would have
+   been (so if that's >= size, it got cut off) */
+size_t ksnprintf(char* buf, size_t size, const char* fmt, ...) {
+    fmtout_t o = { buf, size ? size - 1 : 0, 0, 0, 0 };
+    __builtin_va_list ap;
+    __builtin_va_start(ap, fmt);
+    kvformat(&o, fmt, ap);
+    __builtin_va_end(ap);
+    if (size) {
+        buf[o.len] = '\0';
     }
+    return o.total;
+}
+
+void kprintf(const char* fmt, ...) {
+    char buf[KPRINTFBUF];
+    fmtout_t o = { buf, sizeof(buf), 0, 0, 1 };
+    __builtin_va_list ap;
+    __builtin_va_start(ap, fmt);
+    kvformat(&o, fmt, ap);
+    __builtin_va_end(ap);
+    console_write(buf, o.len);
+    flush(); // (like puts)
 }
 
 void clrscr() {
+    /* Instead of throwing the old screen away, push it up into the scrollback by moving sbtop a whole screen down */
+    con->sbtop = (con->sbtop + VGAHI) % SCROLLBACK;
+    con->sblines = (con->sblines + VGAHI > SCROLLBACK) ? SCROLLBACK : con->sblines + VGAHI;
+    con->sbview = 0;
+    con->vgatop = 0;
+    con->vgadirty = ALLDIRTY;
+
     for (size_t y = 0; y < VGAHI; y++) { // for loops 101: for every time the row is less than the value of total rows, add to y and do:
-        for (size_t x = 0; x < VGAWID; x++) {
-            vmem[y * VGAWID + x] = (uint16_t)' ' | (VGCOL << 8);
-            // Remember that? That's the same thing you saw earlier! Except this time, we're hardwiring what character
-            // we're writing to the screen, which is a blank!
-        }
+        memsetw(sbline(y), (uint16_t)' ' | (con->color << 8), VGAWID); // (a whole row at once)
+        // Remember that? That's the same thing you saw earlier! Except this time, we're hardwiring what character
+        // we're writing to the screen, which is a blank!
     }
 
-    cursorx = 0;
-    cursory = 0;
+    con->cursorx = 0;
+    con->cursory = 0;
     // Now we're resetting the position of the text cursor to the top left, but below, we're writing a string. WILL IT OVERWRITE THE
     // STRING???
-    // answer: no. in the putchr function, it automatically moves the cursor!
+    // answer: no. console_write moves cursorx/cursory along as it goes (the blinking cursor on the screen only catches
+    // up when flush() runs, which puts does for us).
 
     puts("PLACEHOLDER TEXT <----- HERE YOU MIGHT PUT A WELCOME MSG OR SOMETHING\n");
 }
 
 
+#ifndef KRNL_HOSTED // (the hosted build skips parts two and three, and the hardware bits of part 4: see the bottom)
+
 /* Hello! This is where we begin with part two. This part is all about input. */
 
 // So first, we need to read a byte from an I/O port. We will do this using "inb" NOTE: inb can be used for more things
@@ -146,192 +878,3951 @@ static const char asciimap[128] = {
 };
 
 
-/* But see, neither of them will do anything on their own. We need a convertor, and an input reader! */
-
-uint8_t getscan() {
-    while(!(inb(0x64) & 1)) { } // While the keyboard controller doesn't have a key in it, do nothing until there is a key pressed
-    return inb(0x60);
-}
+/* Before the input reader, a detour: interrupts. Asking the keyboard "got a key yet?" over and over keeps the CPU at 100%
+   doing nothing, and any key pressed while we're busy running a command can get lost. Instead, we let the keyboard
+   interrupt us: every key press makes the CPU stop what it's doing and jump to our handler, which tucks the scancode
+   away in a ring buffer. When there's nothing to read, we just "hlt" (sleep) until the next interrupt.
 
-/* For the code above, you're going to need to have knowledge of how ports work (nothing hard really)*/
+   That needs three things: a GDT (the CPU's table of memory segments - the bootloader's one isn't guaranteed to stick
+   around), an IDT (the table of where to jump for each interrupt), and the PIC (the chip that turns IRQ lines into
+   interrupts, which we have to move out of the way of the CPU's own exception numbers). */
 
-char getch() {
-    uint8_t scancode = getscan(); // "scancode" contains the scancode returned by getscan()
-    if (scancode < 128) { /* If the scancode fits in ASCII bounds */
-        return asciimap[scancode]; /* Looks inside the asciimap table and matches the scancode with the letter */
-    }
+#define MAXCPUS 8 // the most CPUs we'll use (see the SMP bit after the threads)
+#define NISR 64 // how many interrupt vectors we have handlers for (0-31 are CPU exceptions, 32-47 are the PIC's IRQs)
+#define IRQBASE 32 // where we move the PIC's IRQs to
+#define KBDRING 256 // how many scancodes we can hold before the reader catches up (a power of 2)
 
-    return 0;
-}
+typedef struct regs { // what the interrupt stubs below leave on the stack for isr_dispatch
+    uint32_t gs, fs, es, ds;
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax; // pusha
+    uint32_t vector, err;
+    uint32_t eip, cs, eflags; // the CPU pushes these itself
+} regs_t;
 
+typedef struct idtent {
+    uint16_t offlo; // handler address, low half
+    uint16_t sel; // code segment
+    uint8_t zero;
+    uint8_t flags; // 0x8E = present, ring 0, 32-bit interrupt gate
+    uint16_t offhi; // handler address, high half
+} __attribute__((packed)) idtent_t;
 
-/* Now for the toughest task of the input sector (yes, this is the toughest one, showing how easy kernel development really is lol)*/
+typedef struct dtptr { // what lgdt/lidt want: the size of the table - 1, then where it is
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) dtptr_t;
 
-void readstr(char* buffer, size_t bufsize) {
-    size_t pos = 0;
-    while (1) {
-        char c = getch();
-        if (c) {
-            if (c == '\b' && pos > 0) { // if the key is backspace:
-                pos--; // take 1 away from virtual position
-                cursorx = (cursorx == 0) ? VGAWID - 1 : cursorx - 1; // new cursor x
-                puts(" \b");
-            }
+#define GDT_TSS (3 + MAXCPUS) // where each CPU's TSS goes in the GDT (see doublefault)
+#define GDT_DFTSS (3 + 2 * MAXCPUS) // ...and the double fault task's
 
-            else if (c == '\n') {
-                putchr('\n');
-                buffer[pos] = '\0';
-                break; // stop reading if enter is pressed!
-            }
+static uint64_t gdt[4 + 2 * MAXCPUS] = {
+    0, // the CPU wants the first entry to be empty
+    0x00CF9A000000FFFFull, // 0x08: code, covers all 4GB
+    0x00CF92000000FFFFull // 0x10: data, covers all 4GB
+    // and then one segment per CPU for its per-CPU data (filled in by percpuinit), one TSS per CPU, and the double
+    // fault task's TSS (those filled in by intinit)
+};
+static idtent_t idt[256];
+static dtptr_t idtr; // (kept around so the other CPUs can load the same IDT)
+static volatile uint32_t* lapic = NULL; // each CPU's local APIC (the SMP code sets this up)
+#define IPIVEC (IRQBASE + 16) // the interrupt CPUs poke each other with
+#define SPURIOUSVEC 63 // what the local APIC sends when it changes its mind about an interrupt
+static void (*irqhandlers[NISR])(regs_t* r); // C handlers for each vector
 
-            else if (pos < bufsize - 1) {
-                buffer[pos++] = c;
-                putchr(c);
-            }
+/* The stubs. The CPU jumps to one of these per vector. Each one pushes a fake error code (if the CPU didn't push a real one)
+   and its vector number, so they all look the same to isr_common, which saves every register and calls isr_dispatch.
+   Every stub is 16 bytes apart, so stub n is at isr_stubs + n * 16. */
+__asm__ (
+    ".pushsection .text\n"
+    ".align 16\n"
+    "isr_stubs:\n"
+    ".set vec, 0\n"
+    ".rept 64\n"
+    "    .align 16\n"
+    "    .if (vec != 8) && (vec < 10 || vec > 14) && (vec != 17)\n"
+    "    push $0\n"
+    "    .endif\n"
+    "    push $vec\n"
+    "    jmp isr_common\n"
+    "    .set vec, vec + 1\n"
+    ".endr\n"
+    "isr_common:\n"
+    "    pusha\n"
+    "    push %ds\n"
+    "    push %es\n"
+    "    push %fs\n"
+    "    push %gs\n"
+    "    mov $0x10, %ax\n"
+    "    mov %ax, %ds\n"
+    "    mov %ax, %es\n"
+    "    cld\n"
+    "    cmpl $0, cpusse\n"
+    "    je 1f\n"
+    "    mov %esp, %ebx\n" // with SSE on, save its registers too, in 512 bytes (16 byte aligned) below the rest
+    "    sub $512, %esp\n"
+    "    and $-16, %esp\n"
+    "    fxsave (%esp)\n"
+    "    sub $12, %esp\n" // (so the stack is still 16 byte aligned at the call, as gcc expects)
+    "    push %ebx\n" // isr_dispatch(regs_t* r)
+    "    call isr_dispatch\n"
+    "    add $16, %esp\n"
+    "    fxrstor (%esp)\n"
+    "    mov %ebx, %esp\n" // (ebx is one isr_dispatch has to leave alone)
+    "    jmp 2f\n"
+    "1:  push %esp\n"
+    "    call isr_dispatch\n"
+    "    add $4, %esp\n"
+    "2:  pop %gs\n"
+    "    pop %fs\n"
+    "    pop %es\n"
+    "    pop %ds\n"
+    "    popa\n"
+    "    add $8, %esp\n" // throw away the vector and error code
+    "    iret\n"
+    ".popsection\n"
+);
+extern char isr_stubs[];
 
+void isr_dispatch(regs_t* r) {
+    if (r->vector < NISR && irqhandlers[r->vector]) {
+        irqhandlers[r->vector](r);
+    } else if (r->vector < IRQBASE) { // a CPU exception nobody handles. Nothing sensible to do but stop
+        puts("\nCPU EXCEPTION! Halting.\n");
+        while (1) {
+            __asm__ __volatile__ ("cli; hlt");
+        }
+    }
 
+    if (r->vector >= IRQBASE && r->vector < IRQBASE + 16) { // tell the PIC(s) we're done, or it won't send that IRQ again
+        if (r->vector >= IRQBASE + 8) {
+            outb(0xA0, 0x20);
         }
+        outb(0x20, 0x20);
+    } else if (r->vector >= IRQBASE + 16 && r->vector != SPURIOUSVEC) { // the rest come from the local APIC, same idea
+        lapic[0xB0 / 4] = 0;
     }
 }
 
-/* Part 3 starts here and is really straightforward, probably the easiest bit.*/
+static void idtset(uint8_t vec, void* handler) {
+    uint32_t addr = (uint32_t)handler;
+    idt[vec].offlo = (uint16_t)(addr & 0xFFFF);
+    idt[vec].sel = 0x08;
+    idt[vec].zero = 0;
+    idt[vec].flags = 0x8E;
+    idt[vec].offhi = (uint16_t)(addr >> 16);
+}
 
+/* The double fault. The CPU raises it when it can't even start on an exception - almost always because the stack is bad,
+   so pushing the exception's frame faulted too. An ordinary handler would need that same stack, and a fault while
+   starting the double fault handler resets the machine ("triple fault") without a word. So vector 8 gets a task gate
+   instead: the CPU saves all the registers into the current TSS (a "task state segment", every CPU loads one of its
+   own with ltr) and loads the double fault task's, which has a stack of its own. That's enough to say what happened. */
+typedef struct tss {
+    uint32_t link; // the task we came from (the CPU fills it in)
+    uint32_t esp0, ss0, esp1, ss1, esp2, ss2; // (stacks for coming from rings 3..1, we don't have any)
+    uint32_t cr3, eip, eflags, eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs, ldt;
+    uint16_t trap, iomap;
+} __attribute__((packed)) tss_t;
 
-void reboot() {
-    __asm__ __volatile__ (
-        "int $0x19" // bios reboot interrupt
-        :
-        :
-        : "memory"
-    );
-}
+static tss_t cputss[MAXCPUS]; // where each CPU's registers go when it switches to the double fault task
+static tss_t dftss; // the double fault task
+static uint8_t dfstack[4096] __attribute__((aligned(16)));
 
+static uint64_t tssdesc(tss_t* t) { // the GDT entry for a TSS: present, ring 0, 32 bit, not busy
+    uint32_t base = (uint32_t)t;
+    return (sizeof(tss_t) - 1) | ((uint64_t)(base & 0xFFFFFF) << 16) | (0x89ull << 40) | ((uint64_t)(base >> 24) << 56);
+}
 
-void cmdHandler(const char *cmd) {
-    if (strcmp(cmd, "help") == 0) {
-        puts("Available cmds: help");
+static void doublefault() { // (we get here by a task switch, not a call, and there's no going back)
+    __asm__ __volatile__ ("clts"); // (a task switch sets CR0.TS, and memcpy wants SSE)
+    tss_t* from = &cputss[(dftss.link >> 3) - GDT_TSS];
+    __asm__ __volatile__ ("mov %0, %%gs" : : "r"((uint16_t)from->gs)); // that CPU's percpu_t again
+    uint32_t addr;
+    __asm__ __volatile__ ("mov %%cr2, %0" : "=r"(addr)); // (what the last page fault was after, if that started it)
+    kprintf("\nDOUBLE FAULT at eip 0x%08X, esp 0x%08X, cr2 0x%08X. Halting.\n", from->eip, from->esp, addr);
+    while (1) {
+        __asm__ __volatile__ ("cli; hlt");
     }
+}
 
-    else if (strcmp(cmd, "reboot") == 0) {
-        reboot();
-    }
+static void irqunmask(uint8_t irq) { // lets one IRQ line through the PIC
+    uint16_t port = (irq < 8) ? 0x21 : 0xA1;
+    outb(port, inb(port) & ~(1u << (irq & 7)));
+}
 
-    else if (strncmp(cmd, "echo ", 5) == 0) {
-        puts(cmd + 5);
-        puts("\n");
-    } 
+/* The keyboard's ring buffer. The interrupt handler is the only one that moves kbdhead, and getscan is the only one
+   that moves kbdtail, so they never have to wait for each other (no locks!). The counters just keep going up, and
+   "% KBDRING" turns them into a spot in the ring. */
+static uint8_t kbdring[KBDRING];
+static volatile uint32_t kbdhead = 0; // where the next scancode goes
+static volatile uint32_t kbdtail = 0; // where the next scancode comes out
 
-    else if (strcmp(cmd, "cls") == 0) {
-        clrscr();
+static void kbdirq(regs_t* r) {
+    (void)r;
+    uint8_t scancode = inb(0x60); // the keyboard won't send another interrupt until we read this
+    trace(TR_KEY, scancode, 0);
+    if (kbdhead - kbdtail < KBDRING) { // if the ring is full the key is dropped (that's 256 keys nobody read!)
+        kbdring[kbdhead % KBDRING] = scancode;
+        __asm__ __volatile__ ("" ::: "memory"); // make sure the scancode is in before we move kbdhead
+        kbdhead = kbdhead + 1;
     }
+}
 
+/* The serial port (COM1). On a machine (or VM) with no screen, this is the console: "qemu -serial stdio" connects it
+   to your terminal. Everything written to the console on the screen goes out here too, and what comes in gets typed
+   into it like the keyboard.
 
-    else {
-        puts("Invalid command!");
-    }
-
+   Sending a byte is an outb, but the port only takes one when it's ready, and asking "ready yet?" for every byte is
+   slow (in a VM every port access is a trip out to the emulator). The chip (a 16550) has a 16 byte FIFO though, and
+   can interrupt when it's empty. So serialwrite just puts the bytes in a ring and returns, and the interrupt handler
+   feeds the FIFO 16 at a time. Incoming bytes get their own ring, like the keyboard's scancodes. */
+#define COM1 0x3F8
+#define SERIALIRQ 4
+#define TXRING 4096 // (powers of 2)
+#define RXRING 256
 
-}
+static void spinlock(volatile int* l); // (part 4)
+static void spinunlock(volatile int* l);
 
+static int serialon = 0; // is there a serial port?
+static uint8_t txring[TXRING];
+static volatile uint32_t txhead = 0, txtail = 0;
+static volatile int txbusy = 0; // has the chip got bytes to send (so it'll interrupt when it's done)?
+static volatile int txlock = 0; // (any CPU can print)
+static uint8_t rxring[RXRING];
+static volatile uint32_t rxhead = 0, rxtail = 0;
 
-/* Here begins part 4! This part will require knowledge about computer memory, so I would take a little crash course on that*/
-#define MEMORY_POOL_SIZE 1024 * 1024  // 1 MB of memory (adjust as needed)
+static inline uint32_t irqsave() { // interrupts off, and were they on before?
+    uint32_t flags;
+    __asm__ __volatile__ ("pushf\n pop %0\n cli" : "=r"(flags) : : "memory");
+    return flags;
+}
 
-// Define a block header for memory management
-typedef struct block_header {
-    size_t size;
-    struct block_header *next;
-} block_header_t;
+static inline void irqrestore(uint32_t flags) {
+    if (flags & 0x200) {
+        __asm__ __volatile__ ("sti" : : : "memory");
+    }
+}
 
-// Memory pool (simulated RAM for our kernel)
-uint8_t memory_pool[MEMORY_POOL_SIZE];
+static void txfill() { // the FIFO's empty: up to 16 bytes from the ring into it
+    for (size_t i = 0; i < 16 && txtail != txhead; i++) {
+        outb(COM1, txring[txtail % TXRING]);
+        txtail = txtail + 1;
+    }
+}
 
-// Pointer to the start of the free memory list
-block_header_t *free_list = (block_header_t*) memory_pool;
+static void txput(uint8_t c) {
+    while (txhead - txtail >= TXRING) { // ring full: nothing for it but to wait for the chip
+        while (!(inb(COM1 + 5) & 0x20)) { // (line status: "transmit FIFO empty")
+        }
+        txfill();
+    }
+    txring[txhead % TXRING] = c;
+    txhead = txhead + 1;
+}
 
-// Initialize memory manager
-void init_memory_manager() {
-    free_list->size = MEMORY_POOL_SIZE - sizeof(block_header_t);
-    free_list->next = NULL;
+static void serialwrite(const char* str, size_t n) {
+    if (!serialon) {
+        return;
+    }
+    uint32_t flags = irqsave(); // (so our own interrupt handler can't come in while we've got the lock)
+    spinlock(&txlock);
+    for (size_t i = 0; i < n; i++) {
+        if (str[i] == '\n') { // terminals want \r\n, or each line starts where the last one ended
+            txput('\r');
+        }
+        txput((uint8_t)str[i]);
+    }
+    if (!txbusy) { // the chip's idle, so get it going. After this the interrupts keep it going
+        txfill();
+        txbusy = 1;
+        outb(COM1 + 1, 0x03); // interrupt on incoming data and "FIFO empty"
+    }
+    spinunlock(&txlock);
+    irqrestore(flags);
 }
 
-// Allocate memory (simple allocator)
-// Fixes block splitting
-void* malloc(size_t size) {
-    block_header_t *prev = NULL;
-    block_header_t *curr = free_list;
-    
-    while (curr) {
-        if (curr->size >= size + sizeof(block_header_t)) { // Ensure space for header
-            // Create a new block for remaining space
-            block_header_t *new_block = (block_header_t*)((uint8_t*)curr + sizeof(block_header_t) + size);
-            new_block->size = curr->size - size - sizeof(block_header_t);
-            new_block->next = curr->next;
-
-            // Link previous block to new free block
-            if (prev) {
-                prev->next = new_block;
+static void serialirq(regs_t* r) {
+    (void)r;
+    spinlock(&txlock);
+    uint8_t iir;
+    while (!((iir = inb(COM1 + 2)) & 1)) { // bit 0 clear: there's (still) something the chip wants
+        if ((iir & 0x06) == 0x04) { // incoming data (or some that's been sitting in the FIFO a while)
+            while (inb(COM1 + 5) & 1) {
+                uint8_t c = inb(COM1);
+                if (rxhead - rxtail < RXRING) {
+                    rxring[rxhead % RXRING] = c;
+                    __asm__ __volatile__ ("" ::: "memory");
+                    rxhead = rxhead + 1;
+                }
+            }
+        } else if ((iir & 0x06) == 0x02) { // the FIFO's empty
+            if (txhead == txtail) { // ...and so are we. Stop the "FIFO empty" interrupts until there's more
+                txbusy = 0;
+                outb(COM1 + 1, 0x01);
             } else {
-                free_list = new_block;
+                txfill();
             }
-
-            curr->size = size;
-            return (void*)(curr + 1); // Return memory after the header
+        } else { // line or modem status changes, which we don't care about (reading them makes the chip stop asking)
+            inb(COM1 + 5);
+            inb(COM1 + 6);
         }
+    }
+    spinunlock(&txlock);
+}
 
-        prev = curr;
-        curr = curr->next;
+void serialinit() {
+    outb(COM1 + 1, 0x00); // no interrupts while we set it up
+    outb(COM1 + 3, 0x80); // the next two are the speed divisor...
+    outb(COM1 + 0, 0x01); // ...115200 / 1 = 115200 baud
+    outb(COM1 + 1, 0x00);
+    outb(COM1 + 3, 0x03); // 8 bits, no parity, 1 stop bit
+    outb(COM1 + 2, 0xC7); // FIFOs on and emptied, interrupt when 14 bytes have come in
+    outb(COM1 + 4, 0x1E); // loopback mode, to check there's a chip there at all: what we send should come back
+    outb(COM1 + 0, 0xAE);
+    if (inb(COM1 + 0) != 0xAE) {
+        return;
     }
+    outb(COM1 + 4, 0x0B); // normal mode, with OUT2 (which connects the chip's interrupt to the PIC)
+    irqhandlers[IRQBASE + SERIALIRQ] = serialirq;
+    serialon = 1;
+    outb(COM1 + 1, 0x01); // interrupt on incoming data
+    irqunmask(SERIALIRQ);
+}
 
-    return NULL; // No memory available
+static inline int inputready() { // anything typed on the keyboard or the serial port?
+    return kbdhead != kbdtail || rxhead != rxtail;
 }
 
+void intinit() {
+    dtptr_t gdtr = { sizeof(gdt) - 1, (uint32_t)gdt };
+    __asm__ __volatile__ (
+        "lgdt %0\n"
+        "ljmp $0x08, $1f\n" // reload cs with our code segment...
+        "1:\n"
+        "mov $0x10, %%ax\n" // ...and every other segment register with our data segment
+        "mov %%ax, %%ds\n"
+        "mov %%ax, %%es\n"
+        "mov %%ax, %%fs\n"
+        "mov %%ax, %%gs\n"
+        "mov %%ax, %%ss\n"
+        : : "m"(gdtr) : "eax", "memory"
+    );
 
-void free(void* ptr) {
-    if (!ptr) return;
+    for (size_t i = 0; i < NISR; i++) {
+        idtset((uint8_t)i, isr_stubs + i * 16);
+    }
+    for (uint32_t i = 0; i < MAXCPUS; i++) {
+        gdt[GDT_TSS + i] = tssdesc(&cputss[i]);
+    }
+    gdt[GDT_DFTSS] = tssdesc(&dftss);
+    dftss.esp = (uint32_t)(dfstack + sizeof(dfstack)); // (the error code the CPU pushes is doublefault's "return address")
+    dftss.eip = (uint32_t)doublefault;
+    dftss.eflags = 0x2; // interrupts off
+    dftss.cs = 0x08;
+    dftss.ss = dftss.ds = dftss.es = dftss.fs = dftss.gs = 0x10;
+    dftss.iomap = sizeof(tss_t); // (no I/O permission bitmap)
+    idt[8].offlo = idt[8].offhi = 0; // a task gate: no handler address, just the TSS to switch to
+    idt[8].sel = GDT_DFTSS * 8;
+    idt[8].flags = 0x85;
+    __asm__ __volatile__ ("ltr %0" : : "r"((uint16_t)(GDT_TSS * 8))); // this CPU's TSS (the others load theirs in ap_main)
+    idtr.limit = sizeof(idt) - 1;
+    idtr.base = (uint32_t)idt;
+    __asm__ __volatile__ ("lidt %0" : : "m"(idtr));
 
-    block_header_t* block = (block_header_t*)((uint8_t*)ptr - sizeof(block_header_t));
-    block_header_t* curr = free_list;
-    block_header_t* prev = NULL;
+    /* Remap the PICs: IRQ 0-7 to vectors 32-39 and IRQ 8-15 to 40-47 (by default they'd land on top of CPU exceptions) */
+    outb(0x20, 0x11); // start the init sequence
+    outb(0xA0, 0x11);
+    outb(0x21, IRQBASE); // master's vector offset
+    outb(0xA1, IRQBASE + 8); // slave's vector offset
+    outb(0x21, 0x04); // tell the master the slave is on IRQ2
+    outb(0xA1, 0x02); // tell the slave it's on IRQ2
+    outb(0x21, 0x01); // 8086 mode
+    outb(0xA1, 0x01);
+    outb(0x21, 0xFF); // mask everything for now...
+    outb(0xA1, 0xFF);
 
-    // Find where to insert this block
-    while (curr && curr < block) {
-        prev = curr;
-        curr = curr->next;
+    irqhandlers[IRQBASE + 1] = kbdirq; // ...then let the keyboard (IRQ1) and the slave PIC (IRQ2) through
+    irqunmask(2);
+    irqunmask(1);
+    while (inb(0x64) & 1) { // throw away anything already sitting in the keyboard controller, or it'll never interrupt
+        inb(0x60);
     }
 
-    // Insert block back into free list
-    block->next = curr;
-    if (prev) {
-        prev->next = block;
+    __asm__ __volatile__ ("sti"); // and turn interrupts on!
+}
 
-        // Merge adjacent free blocks
-        if ((uint8_t*)prev + prev->size + sizeof(block_header_t) == (uint8_t*)block) {
-            prev->size += block->size + sizeof(block_header_t);
-            prev->next = block->next;
-        }
-    } else {
-        free_list = block;
-    }
 
-    // Merge with the next block if adjacent
-    if (curr && (uint8_t*)block + block->size + sizeof(block_header_t) == (uint8_t*)curr) {
-        block->size += curr->size + sizeof(block_header_t);
-        block->next = curr->next;
+/* While we're messing with interrupts: time. The PIT (the timer chip every PC has) can interrupt us HZ times a second,
+   which gives us "jiffies" - a count of ticks since boot. That's only good to a millisecond though, so for anything
+   finer we use the TSC, a counter inside the CPU that goes up every clock cycle and costs almost nothing to read.
+   We just have to find out how fast it counts, by timing it against the PIT once at boot. */
+
+#define HZ 1000 // timer interrupts per second
+#define PITHZ 1193182 // the PIT's input clock
+#define CALIBTICKS 50 // how many ticks (ms) we spend timing the TSC at boot
+
+static volatile uint32_t jiffies = 0; // ticks since timerinit()
+static uint64_t tscboot = 0; // the TSC when we booted (well, when timerinit ran)
+static uint32_t tsckhz = 0; // TSC ticks per millisecond
+static uint32_t tscmult = 0; // now_ns() does (tsc * tscmult) >> tscshift, which is a multiply instead of a divide
+static uint32_t tscshift = 0;
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* 64 bit divided by 32 bit. A plain "/" on a 64 bit number needs a helper from libgcc that we don't have,
+   but the CPU's divl can do it in two steps (top half first, then the remainder with the bottom half) */
+static uint64_t div64(uint64_t n, uint32_t d, uint32_t* rem) {
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t lo = (uint32_t)n;
+    uint32_t qhi = hi / d;
+    uint32_t r = hi % d;
+    uint32_t qlo;
+    __asm__ ("divl %4" : "=a"(qlo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    if (rem) {
+        *rem = r;
     }
+    return ((uint64_t)qhi << 32) | qlo;
 }
 
+/* (a * mul) >> shift without losing the top of the 96 bit answer */
+static uint64_t mulshr(uint64_t a, uint32_t mul, uint32_t shift) {
+    uint64_t lo = (uint64_t)(uint32_t)a * mul;
+    uint64_t hi = (uint64_t)(uint32_t)(a >> 32) * mul;
+    return (lo >> shift) + (hi << (32 - shift));
+}
 
-/* I'm not actually going to use the memory allocation here, but you can do what you feel like. */
+uint64_t now_ns() { // nanoseconds since boot
+    return mulshr(rdtsc() - tscboot, tscmult, tscshift);
+}
 
-void krnlMain() {
-    clrscr();
-    char ibuffer[MAXBUFSZ];
+/* The timer wheel: a way to say "call this function in N ms" that costs the same no matter how many timers there are.
+   Think of a clock with 64 slots: a timer due in 5 ticks goes in the slot 5 ahead of the hand, and every tick we run
+   whatever is in the slot the hand points at. Timers too far away for that go on a slower wheel (64 slots of 64 ticks),
+   and so on for 4 wheels (2^24 ticks, about 4.5 hours). Whenever the fast wheel goes round once, we take the next slot
+   of the slower wheel and spread its timers out over the fast one ("cascading").
+   Adding and cancelling are just linking/unlinking a list, no searching, no sorting. */
+#define WHEELBITS 6
+#define WHEELSIZE (1u << WHEELBITS)
+#define WHEELS 4
+#define WHEELMAX ((1u << (WHEELBITS * WHEELS)) - 1) // the furthest a timer can be in the future
+
+typedef struct ktimer {
+    struct ktimer* next;
+    struct ktimer** pprev; // whatever points at us (so we can unlink ourselves without knowing which slot we're in)
+    uint32_t expires; // the jiffy we should run at
+    void (*fn)(void* arg);
+    void* arg;
+} ktimer_t;
+
+static ktimer_t* wheel[WHEELS][WHEELSIZE];
+static uint32_t wheelnow = 0; // the tick the wheel has run up to (it can fall behind jiffies, it catches up in timers_run)
+
+static void timer_link(ktimer_t* t) {
+    uint32_t delta = t->expires - wheelnow;
+    ktimer_t** slot;
+    if ((int32_t)delta < 0) { // already late, run it on the next tick
+        slot = &wheel[0][wheelnow & (WHEELSIZE - 1)];
+    } else {
+        if (delta > WHEELMAX) {
+            t->expires = wheelnow + WHEELMAX;
+            delta = WHEELMAX;
+        }
+        size_t level = 0;
+        while (level < WHEELS - 1 && delta >= (1u << (WHEELBITS * (level + 1)))) {
+            level++;
+        }
+        slot = &wheel[level][(t->expires >> (WHEELBITS * level)) & (WHEELSIZE - 1)];
+    }
+
+    t->next = *slot;
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+}
+
+void timer_cancel(ktimer_t* t) {
+    if (!t->pprev) {
+        return; // not armed
+    }
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+void timer_add(ktimer_t* t, uint32_t ms, void (*fn)(void* arg), void* arg) { // calls fn(arg) in (about) ms milliseconds
+    timer_cancel(t);
+    t->fn = fn;
+    t->arg = arg;
+    t->expires = jiffies + (ms * HZ + 999) / 1000;
+    timer_link(t);
+}
+
+static size_t cascade(size_t level) { // spreads one slot of a slower wheel out over the faster ones
+    size_t idx = (wheelnow >> (WHEELBITS * level)) & (WHEELSIZE - 1);
+    ktimer_t* t = wheel[level][idx];
+    wheel[level][idx] = NULL;
+    while (t) {
+        ktimer_t* next = t->next;
+        timer_link(t);
+        t = next;
+    }
+    return idx;
+}
+
+/* Runs every timer that's due. This is called by the idle thread (not from the interrupt), so timer functions are free to
+   print, wake threads up and so on without tripping over whatever the interrupt happened to interrupt. */
+void timers_run() {
+    while ((int32_t)(jiffies - wheelnow) >= 0) {
+        size_t idx = wheelnow & (WHEELSIZE - 1);
+        for (size_t level = 1; level < WHEELS && idx == 0; level++) { // the fast wheel went all the way round
+            idx = cascade(level);
+        }
+        idx = wheelnow & (WHEELSIZE - 1);
+
+        ktimer_t* pending = wheel[0][idx]; // take the whole slot off the wheel...
+        wheel[0][idx] = NULL;
+        if (pending) {
+            pending->pprev = &pending; // (so a timer function cancelling one of the others still unlinks it properly)
+        }
+        wheelnow++;
+        while (pending) { // ...and run it one timer at a time
+            ktimer_t* t = pending;
+            pending = t->next;
+            if (pending) {
+                pending->pprev = &pending;
+            }
+            t->next = NULL;
+            t->pprev = NULL;
+            t->fn(t->arg); // (it's allowed to add itself again)
+        }
+    }
+}
+
+static volatile int profon = 0; // is the profiler (way down at the bottom) collecting samples?
+static void profsample(uint32_t eip);
+
+static void pitirq(regs_t* r) {
+    jiffies = jiffies + 1;
+    if (profon) { // one check per tick when the profiler is off, that's all it costs
+        profsample(r->eip);
+    }
+}
+
+void timerinit() {
+    uint16_t divisor = (uint16_t)((PITHZ + HZ / 2) / HZ);
+    outb(0x43, 0x34); // channel 0, low byte then high byte, mode 2 (rate generator)
+    outb(0x40, (uint8_t)(divisor & 0xFF));
+    outb(0x40, (uint8_t)(divisor >> 8));
+    irqhandlers[IRQBASE + 0] = pitirq;
+    irqunmask(0);
+
+    /* Now time the TSC: wait for a tick to start, count CALIBTICKS ticks and see how far the TSC got */
+    uint32_t start = jiffies;
+    while (jiffies == start) {
+        __asm__ __volatile__ ("hlt");
+    }
+    uint64_t t0 = rdtsc();
+    start = jiffies;
+    while (jiffies - start < CALIBTICKS) {
+        __asm__ __volatile__ ("hlt");
+    }
+    uint64_t t1 = rdtsc();
+    tsckhz = (uint32_t)div64(t1 - t0, CALIBTICKS * 1000 / HZ, NULL);
+
+    /* ns = tsc * 1000000 / tsckhz. Turn "* 1000000 / tsckhz" into "* tscmult >> tscshift", with the biggest shift
+       that still fits tscmult in 32 bits (bigger shift = more precise) */
+    tscshift = 32;
+    uint64_t mult = div64(1000000ull << 32, tsckhz, NULL);
+    while (mult >> 32) {
+        tscshift--;
+        mult = div64(1000000ull << tscshift, tsckhz, NULL);
+    }
+    tscmult = (uint32_t)mult;
+    tscboot = t0;
+    wheelnow = jiffies;
+}
+
+
+/* But see, neither of them will do anything on their own. We need a convertor, and an input reader! */
+
+static void kbdwait(); // (part of the threads, after part 4)
+
+uint8_t getscan() {
+    while (kbdhead == kbdtail) { // Nothing typed yet. Instead of asking the keyboard over and over, this thread goes to
+        kbdwait(); // sleep, and other threads get to run. The idle thread wakes us up when a key comes in
+    }
+    uint8_t scancode = kbdring[kbdtail % KBDRING];
+    kbdtail = kbdtail + 1;
+    return scancode;
+}
+
+/* For the code above, you're going to need to have knowledge of how ports work (nothing hard really)*/
+
+static int shiftdown = 0; // is a shift key being held?
+static int altdown = 0; // is an alt key being held?
+static int e0prefix = 0; // "extended" keys (like PgUp/PgDn on their own block) send 0xE0 before their scancode
+
+static int rxlastcr = 0; // was the last serial byte a \r? (then a \n right after it is the same Enter)
+
+char getch() {
+    while (!inputready()) {
+        kbdwait();
+    }
+    if (rxhead != rxtail) { // the serial port sends ASCII already, so no scancodes to work out
+        char c = (char)rxring[rxtail % RXRING];
+        rxtail = rxtail + 1;
+        int cr = rxlastcr;
+        rxlastcr = c == '\r';
+        if (c == '\n' && cr) {
+            return 0;
+        }
+        if (c == '\r') { // (Enter, in a terminal)
+            return '\n';
+        }
+        if (c == 0x7F) { // (and backspace)
+            return '\b';
+        }
+        return c;
+    }
+
+    uint8_t scancode = getscan(); // "scancode" contains the scancode returned by getscan()
+    if (scancode == 0xE0) {
+        e0prefix = 1;
+        return 0;
+    }
+
+    int extended = e0prefix;
+    e0prefix = 0;
+    if (scancode == 0x2A || scancode == 0x36 || scancode == 0xAA || scancode == 0xB6) { // left/right shift pressed/released
+        if (!extended) { // the keyboard sends "fake" shifts around extended keys, ignore those
+            shiftdown = !(scancode & 0x80);
+        }
+        return 0;
+    }
+
+    if (scancode == 0x38 || scancode == 0xB8) { // alt pressed/released (right alt is the same thing with 0xE0 in front)
+        altdown = !(scancode & 0x80);
+        return 0;
+    }
+
+    if (altdown && scancode >= 0x3B && scancode < 0x3B + NCONSOLES) { // Alt+F1, Alt+F2... switch virtual consoles
+        conswitch(scancode - 0x3B);
+        return 0;
+    }
+
+    if (shiftdown && (scancode == 0x49 || scancode == 0x51)) { // Shift+PgUp / Shift+PgDn walk through the scrollback
+        sbscroll(scancode == 0x49 ? VGAHI / 2 : -(VGAHI / 2));
+        return 0;
+    }
+
+    if (extended) { // we don't have anything for the other extended keys (arrows etc.) yet
+        return 0;
+    }
+
+    if (scancode < 128) { /* If the scancode fits in ASCII bounds */
+        return asciimap[scancode]; /* Looks inside the asciimap table and matches the scancode with the letter */
+    }
+
+    return 0;
+}
+
+
+/* Now for the toughest task of the input sector (yes, this is the toughest one, showing how easy kernel development really is lol)*/
+
+void readstr(char* buffer, size_t bufsize) {
     while (1) {
-        puts("PROMPT >>> ");
-        readstr(ibuffer, sizeof(ibuffer));
-        cmdHandler(ibuffer);
+        con = fgcon; // typing always goes to whichever console is on the screen
+        flush(); // whatever we echoed has to be on screen before we sit and wait for a key
+        char c = getch();
+        con = fgcon; // (getch might have just switched consoles on us)
+        if (c) {
+            if (c == '\b') { // if the key is backspace:
+                if (con->linepos > 0) { // (and there's something to rub out - otherwise we'd eat the prompt!)
+                    con->linepos--; // take 1 away from virtual position
+                    console_write("\b \b", 3); // step back, rub the character out with a space, step back again
+                }
+            }
+
+            else if (c == '\n') {
+                console_write("\n", 1);
+                size_t pos = 0;
+                while (pos < con->linepos && pos < bufsize - 1) { // hand the console's line over to the caller
+                    buffer[pos] = con->line[pos];
+                    pos++;
+                }
+                buffer[pos] = '\0';
+                con->linepos = 0;
+                break; // stop reading if enter is pressed! (con is left on this console, so the command's output lands here)
+            }
+
+            else if (con->linepos < bufsize - 1 && con->linepos < MAXBUFSZ - 1) {
+                con->line[con->linepos++] = c;
+                console_write(&c, 1);
+            }
+
+
+        }
+    }
+}
+
+/* Bonus round: graphics mode! Remember the frame buffer at 0xA0000 from the very top? In mode 13h the screen is 320x200 pixels
+   and every pixel is one byte of memory holding a colour number. There's no font anymore, so WE have to draw every letter.
+
+   To keep this fast we do the same thing as in text mode: draw into a copy of the screen in normal RAM (the back buffer),
+   remember the rectangle that changed, and only copy that rectangle to the real frame buffer, 4 pixels per write. */
+
+/* The VGA register values for mode 13h. We can't ask the BIOS to switch modes for us from here, so we poke them in ourselves */
+static const uint8_t mode13h[] = {
+    0x63, // misc output
+    0x03, 0x01, 0x0F, 0x00, 0x0E, // sequencer
+    0x5F, 0x4F, 0x50, 0x82, 0x54, 0x80, 0xBF, 0x1F, 0x00, 0x41, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // CRTC
+    0x9C, 0x0E, 0x8F, 0x28, 0x40, 0x96, 0xB9, 0xA3, 0xFF,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x05, 0x0F, 0xFF, // graphics controller
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, // attribute controller
+    0x41, 0x00, 0x0F, 0x00, 0x00
+};
+
+/* The 16 text mode colours, so the colour half of a text cell (like VGCOL) still means the same thing. (red, green, blue, 0-63) */
+static const uint8_t palette16[16][3] = {
+    { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x2A }, { 0x00, 0x2A, 0x00 }, { 0x00, 0x2A, 0x2A },
+    { 0x2A, 0x00, 0x00 }, { 0x2A, 0x00, 0x2A }, { 0x2A, 0x15, 0x00 }, { 0x2A, 0x2A, 0x2A },
+    { 0x15, 0x15, 0x15 }, { 0x15, 0x15, 0x3F }, { 0x15, 0x3F, 0x15 }, { 0x15, 0x3F, 0x3F },
+    { 0x3F, 0x15, 0x15 }, { 0x3F, 0x15, 0x3F }, { 0x3F, 0x3F, 0x15 }, { 0x3F, 0x3F, 0x3F }
+};
+
+/* An 8x8 font for the printable characters (space to ~). Each byte is one row, and the lowest bit is the leftmost pixel */
+static const uint8_t font8x8[95][8] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // (space)
+    { 0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00 }, // !
+    { 0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // "
+    { 0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00 }, // #
+    { 0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00 }, // $
+    { 0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00 }, // %
+    { 0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00 }, // &
+    { 0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 }, // '
+    { 0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00 }, // (
+    { 0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00 }, // )
+    { 0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00 }, // *
+    { 0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00 }, // +
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06 }, // ,
+    { 0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00 }, // -
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00 }, // .
+    { 0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00 }, // /
+    { 0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00 }, // 0
+    { 0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00 }, // 1
+    { 0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00 }, // 2
+    { 0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00 }, // 3
+    { 0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00 }, // 4
+    { 0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00 }, // 5
+    { 0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00 }, // 6
+    { 0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00 }, // 7
+    { 0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00 }, // 8
+    { 0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00 }, // 9
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00 }, // :
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06 }, // ;
+    { 0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00 }, // <
+    { 0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00 }, // =
+    { 0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00 }, // >
+    { 0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00 }, // ?
+    { 0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00 }, // @
+    { 0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00 }, // A
+    { 0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00 }, // B
+    { 0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00 }, // C
+    { 0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00 }, // D
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00 }, // E
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00 }, // F
+    { 0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00 }, // G
+    { 0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00 }, // H
+    { 0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 }, // I
+    { 0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00 }, // J
+    { 0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00 }, // K
+    { 0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00 }, // L
+    { 0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00 }, // M
+    { 0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00 }, // N
+    { 0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00 }, // O
+    { 0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00 }, // P
+    { 0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00 }, // Q
+    { 0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00 }, // R
+    { 0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00 }, // S
+    { 0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 }, // T
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00 }, // U
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 }, // V
+    { 0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00 }, // W
+    { 0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00 }, // X
+    { 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00 }, // Y
+    { 0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00 }, // Z
+    { 0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00 }, // [
+    { 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00 }, // (backslash)
+    { 0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00 }, // ]
+    { 0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00 }, // ^
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF }, // _
+    { 0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00 }, // `
+    { 0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00 }, // a
+    { 0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00 }, // b
+    { 0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00 }, // c
+    { 0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00 }, // d
+    { 0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00 }, // e
+    { 0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00 }, // f
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F }, // g
+    { 0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00 }, // h
+    { 0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 }, // i
+    { 0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E }, // j
+    { 0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00 }, // k
+    { 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 }, // l
+    { 0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00 }, // m
+    { 0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00 }, // n
+    { 0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00 }, // o
+    { 0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F }, // p
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78 }, // q
+    { 0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00 }, // r
+    { 0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00 }, // s
+    { 0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00 }, // t
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00 }, // u
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 }, // v
+    { 0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00 }, // w
+    { 0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00 }, // x
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F }, // y
+    { 0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00 }, // z
+    { 0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00 }, // {
+    { 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00 }, // |
+    { 0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00 }, // }
+    { 0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // ~
+};
+
+static uint32_t* gfxmem = (uint32_t*)GFXMEM; // 4 pixels at a time
+static uint32_t backbuf[GFXHI][GFXWID / 4]; // the back buffer, same layout as the real thing
+static uint16_t gfxcells[VGAHI][GFXCOLS]; // which text cell is drawn in each spot of the back buffer right now
+static size_t gfxdx0, gfxdy0, gfxdx1, gfxdy1; // the dirty rectangle (in text cells), empty when x0 > x1
+#define GFXNOCELL 0xFFFF // a gfxcells value that means "draw this spot again"
+static int gfxblink = 1; // is the cursor showing right now
+static ktimer_t gfxblinktimer;
+
+/* The glyph cache. Drawing a letter pixel by pixel is 64 "is this bit set?" checks. Instead we turn every letter into
+   ready-made rows of pixels once (for the colour it's being drawn in), so drawing it is just 16 copies. */
+static uint32_t expand[256][2]; // a byte of font bits -> 8 bytes that are 0xFF where the bit was set
+static uint32_t glyphs[128][8][2]; // the ready-made letters
+static uint16_t glyphcol[128]; // the colour each cached letter was made in, plus 1 (0 = not made yet)
+
+static void gfxcell(size_t cx, size_t cy, uint16_t cell) {
+    uint8_t ch = (uint8_t)cell;
+    uint8_t col = (uint8_t)(cell >> 8);
+    if (ch >= 128) {
+        ch = '?';
+    }
+
+    if (glyphcol[ch] != col + 1u) { // not in the cache in this colour yet, make it
+        uint32_t fg = (col & 0x0F) * 0x01010101u; // the colour number copied into all 4 bytes
+        uint32_t bg = (col >> 4) * 0x01010101u;
+        for (size_t r = 0; r < 8; r++) {
+            uint8_t bits = (ch >= 32 && ch < 127) ? font8x8[ch - 32][r] : 0;
+            glyphs[ch][r][0] = (expand[bits][0] & fg) | (~expand[bits][0] & bg);
+            glyphs[ch][r][1] = (expand[bits][1] & fg) | (~expand[bits][1] & bg);
+        }
+        glyphcol[ch] = col + 1u;
+    }
+
+    for (size_t r = 0; r < 8; r++) {
+        backbuf[cy * 8 + r][cx * 2] = glyphs[ch][r][0];
+        backbuf[cy * 8 + r][cx * 2 + 1] = glyphs[ch][r][1];
+    }
+    gfxcells[cy][cx] = cell;
+
+    if (cx < gfxdx0) gfxdx0 = cx; // grow the dirty rectangle to cover this cell
+    if (cx > gfxdx1) gfxdx1 = cx;
+    if (cy < gfxdy0) gfxdy0 = cy;
+    if (cy > gfxdy1) gfxdy1 = cy;
+}
+
+static void gfxflush(console_t* c) {
+    size_t cursor = c->cursory * GFXCOLS + c->cursorx;
+    if (!c->vgadirty && cursorshown == cursor) {
+        return; // nothing changed
+    }
+
+    /* The screen doesn't scroll by itself in graphics mode, so rather than trusting the dirty rows we compare every cell
+       against what's already drawn. That's 1000 compares in normal RAM, and only cells that really changed get drawn */
+    size_t first = c->sbtop + SCROLLBACK - c->sbview;
+    for (size_t y = 0; y < VGAHI; y++) {
+        uint16_t* line = c->scrollback[(first + y) % SCROLLBACK];
+        for (size_t x = 0; x < GFXCOLS; x++) {
+            if (line[x] != gfxcells[y][x]) {
+                gfxcell(x, y, line[x]);
+            }
+        }
+    }
+
+    /* No hardware cursor either, so we draw an underline under the cursor cell (every other half second, so it blinks).
+       That cell gets drawn again every time, so the underline disappears when the cursor moves on */
+    if (!c->sbview && c->cursorx < GFXCOLS && gfxblink) {
+        gfxcell(c->cursorx, c->cursory, c->scrollback[(c->sbtop + c->cursory) % SCROLLBACK][c->cursorx]);
+        backbuf[c->cursory * 8 + 7][c->cursorx * 2] = (c->color & 0x0F) * 0x01010101u;
+        backbuf[c->cursory * 8 + 7][c->cursorx * 2 + 1] = (c->color & 0x0F) * 0x01010101u;
+        gfxcells[c->cursory][c->cursorx] = GFXNOCELL;
+    }
+    cursorshown = cursor;
+
+    if (gfxdx0 > gfxdx1) {
+        return;
+    }
+    for (size_t py = gfxdy0 * 8; py < (gfxdy1 + 1) * 8; py++) { // copy just the dirty rectangle to the screen
+        memcpy(gfxmem + py * (GFXWID / 4) + gfxdx0 * 2, &backbuf[py][gfxdx0 * 2], (gfxdx1 + 1 - gfxdx0) * 8);
+    }
+    gfxdx0 = gfxdy0 = (size_t)-1; // and the rectangle is empty again
+    gfxdx1 = gfxdy1 = 0;
+}
+
+static void gfxblinker(void* arg) {
+    (void)arg;
+    gfxblink = !gfxblink;
+    cursorshown = (size_t)-1; // makes gfxflush draw the cursor cell again even though the cursor didn't move
+    conflush(fgcon);
+    timer_add(&gfxblinktimer, 500, gfxblinker, NULL);
+}
+
+static void gfxredraw() { // forget what's drawn, so the next flush draws the whole screen
+    memsetw(&gfxcells[0][0], GFXNOCELL, VGAHI * GFXCOLS);
+    fgcon->vgadirty = ALLDIRTY;
+}
+
+/* Switches the screen to mode 13h and keeps the consoles going in it. There's no way back to text mode (switching
+   scribbles over the text mode font, and we'd have to put it back), so this is a one-way trip until you reboot. */
+void gfxinit() {
+    if (gfxmode) {
+        return;
+    }
+
+    const uint8_t* regs = mode13h;
+    outb(0x3C2, *regs++);
+    for (uint8_t i = 0; i < 5; i++) {
+        outb(0x3C4, i);
+        outb(0x3C5, *regs++);
+    }
+    outb(0x3D4, 0x11); // the CRTC registers are write protected, so unlock them first
+    outb(0x3D5, inb(0x3D5) & 0x7F);
+    for (uint8_t i = 0; i < 25; i++) {
+        outb(0x3D4, i);
+        outb(0x3D5, (i == 0x11) ? (*regs++ & 0x7F) : *regs++);
+    }
+    for (uint8_t i = 0; i < 9; i++) {
+        outb(0x3CE, i);
+        outb(0x3CF, *regs++);
+    }
+    for (uint8_t i = 0; i < 21; i++) {
+        inb(0x3DA); // reading this resets the attribute controller, so the next write is an index
+        outb(0x3C0, i);
+        outb(0x3C0, *regs++);
+    }
+    inb(0x3DA);
+    outb(0x3C0, 0x20); // turn the screen back on
+
+    outb(0x3C8, 0); // and load our 16 colours, starting at colour 0
+    for (size_t i = 0; i < 16; i++) {
+        outb(0x3C9, palette16[i][0]);
+        outb(0x3C9, palette16[i][1]);
+        outb(0x3C9, palette16[i][2]);
+    }
+
+    for (size_t b = 0; b < 256; b++) {
+        uint8_t* mask = (uint8_t*)expand[b];
+        for (size_t i = 0; i < 8; i++) {
+            mask[i] = (b & (1u << i)) ? 0xFF : 0x00;
+        }
+    }
+
+    gfxmode = 1;
+    concols = GFXCOLS;
+    console_t* old = con;
+    for (size_t i = 0; i < NCONSOLES; i++) { // cursors past column 40 would be off the screen now
+        con = &consoles[i];
+        if (con->cursorx >= GFXCOLS) {
+            newline();
+        }
+    }
+    con = old;
+
+    gfxdx0 = gfxdy0 = (size_t)-1;
+    gfxdx1 = gfxdy1 = 0;
+    gfxredraw();
+    conflush(fgcon);
+    timer_add(&gfxblinktimer, 500, gfxblinker, NULL);
+}
+
+/* Part 3 starts here and is really straightforward, probably the easiest bit.*/
+
+
+void reboot() {
+    __asm__ __volatile__ (
+        "int $0x19" // bios reboot interrupt
+        :
+        :
+        : "memory"
+    );
+}
+
+
+void profcmd(uint32_t argc, char** argv); // the profiler's and tracer's commands live down with them
+void tracecmd(uint32_t argc, char** argv);
+void pscmd(); // and these two with the threads
+void sleep(uint32_t ms);
+void smpbench(); // and this one with the SMP stuff
+void meminfo(); // and this one with the memory manager
+void* scratch(size_t size); // the command's scratch memory (with the threads too)
+void scratchreset();
+
+static char** cmdsplit(const char* cmd, uint32_t* argc) { // cuts the command up at the spaces: "trace dump 5" -> "trace", "dump", "5"
+    size_t len = strlen(cmd);
+    uint32_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (cmd[i] != ' ' && (i == 0 || cmd[i - 1] == ' ')) {
+            n++;
+        }
+    }
+
+    char** argv = scratch((n + 1) * sizeof(char*));
+    char* copy = scratch(len + 1);
+    if (!argv || !copy) {
+        *argc = 0;
+        return NULL;
+    }
+    n = 0;
+    for (size_t i = 0; i <= len; i++) {
+        copy[i] = cmd[i] == ' ' ? '\0' : cmd[i];
+        if (cmd[i] && cmd[i] != ' ' && (i == 0 || cmd[i - 1] == ' ')) {
+            argv[n++] = &copy[i];
+        }
+    }
+    argv[n] = NULL;
+    *argc = n;
+    return argv;
+}
+
+void cmdHandler(const char *cmd) {
+    uint32_t name = 0; // the first 4 letters of the command, squashed into one number for the tracer
+    for (size_t i = 0; i < 4 && cmd[i]; i++) {
+        name |= (uint32_t)(uint8_t)cmd[i] << (i * 8);
+    }
+    trace(TR_CMD, name, strlen(cmd));
+    uint32_t argc;
+    char** argv = cmdsplit(cmd, &argc); // (this and anything else from scratch() goes away at the end)
+    const char* verb = argc ? argv[0] : ""; // commands go by this, so spaces around them don't matter
+
+    if (strcmp(verb, "help") == 0) {
+        puts("Available cmds: help, reboot, echo, cls, gfx, uptime, prof, trace,\nps, sleep <ms>, smpbench, meminfo\n(end a command with & to run it in the background)");
+    }
+
+    else if (strcmp(verb, "reboot") == 0) {
+        reboot();
+    }
+
+    else if (strncmp(cmd, "echo ", 5) == 0) { // (except echo, which wants its text exactly as it was typed, spaces and all)
+        console_write(cmd + 5, strlen(cmd + 5));
         puts("\n");
-        
+    } 
+
+    else if (strcmp(verb, "cls") == 0) {
+        clrscr();
+    }
+
+    else if (strcmp(verb, "gfx") == 0) {
+        gfxinit();
+    }
+
+    else if (strcmp(verb, "prof") == 0) {
+        profcmd(argc, argv);
+    }
+
+    else if (strcmp(verb, "trace") == 0) {
+        tracecmd(argc, argv);
+    }
+
+    else if (strcmp(verb, "ps") == 0) {
+        pscmd();
+    }
+
+    else if (strcmp(verb, "sleep") == 0 && argc == 2) {
+        sleep((uint32_t)atoi(argv[1]));
+    }
+
+    else if (strcmp(verb, "smpbench") == 0) {
+        smpbench();
+    }
+
+    else if (strcmp(verb, "meminfo") == 0) {
+        meminfo();
+    }
+
+    else if (strcmp(verb, "uptime") == 0) {
+        uint32_t ms;
+        uint64_t secs = div64(div64(now_ns(), 1000000, NULL), 1000, &ms);
+        kprintf("Up for %u.%03u seconds (%u ticks, TSC runs at %u MHz)", (uint32_t)secs, ms, jiffies, tsckhz / 1000);
+    }
+
+
+    else {
+        puts("Invalid command!");
+    }
+
+    scratchreset();
+    trace(TR_CMDDONE, name, 0);
+}
+
+#else // what the hosted build has instead of all that
+
+#define MAXCPUS 1
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void gfxflush(console_t* c) {
+    (void)c;
+}
+
+static void gfxredraw() {
+}
+
+static void serialwrite(const char* str, size_t n) {
+    (void)str;
+    (void)n;
+}
+
+#endif
+
+
+/* Here begins part 4! This part will require knowledge about computer memory, so I would take a little crash course on that*/
+
+// Define a block header for memory management (see the heap, after the slabs)
+typedef struct block_header {
+    size_t prevsize; // the size of the block before this one, but only if that one is free (its "footer")
+    size_t size; // the low bits are BLOCKFREE and PREVFREE
+    struct block_header *next; // these two only mean something while the block is free
+    struct block_header *prev;
+} block_header_t; // (16 bytes, so with 16 byte block sizes the data after it always starts 16 byte aligned)
+
+/* Once there's more than one CPU (see the SMP bit after the threads), two of them could change the heap's lists at the same
+   time and make a mess of it. A spinlock stops that: whoever gets it first goes, the other one waits (spins). */
+static volatile int heaplock = 0;
+
+static void spinlock(volatile int* l) {
+    while (__sync_lock_test_and_set(l, 1)) { // atomically "set it to 1 and tell me what it was"
+        while (*l) {
+            __asm__ __volatile__ ("pause"); // tells the CPU we're spinning, so it takes it easy
+        }
+    }
+}
+
+static void spinunlock(volatile int* l) {
+    __sync_lock_release(l);
+}
+
+/* Pages! Underneath everything, memory is cut into 4KB pages, handed out by a "buddy allocator": you ask for 2^order
+   pages at once, and get a block that starts at a multiple of its own size. Every block has exactly one "buddy" - the
+   other half of the block twice its size - and it's at (page number XOR 2^order). So when a block is freed and its
+   buddy is free too, the two merge back into the bigger block, and so on up. That keeps memory from crumbling into
+   little bits, and both alloc_pages and free_pages only ever go up or down the orders, never search.
+
+   RAM isn't one big piece though (there are holes in it, and our kernel is sitting in it), so every usable piece is a
+   "zone" of its own, with its own lists. Which blocks are free is kept twice: a list per order (to find one fast),
+   and a bitmap per order (to check a buddy fast). Each page also has a little descriptor (page_t) that says what
+   it's being used for. A zone keeps its descriptors and bitmaps in its own first few pages. */
+#define PAGESIZE 4096
+#define MAXORDER 10 // 2^10 pages = 4MB, the biggest block there is
+#define MAXZONES 16
+#define VHEAPBASE 0xC0000000u // where the heap lives once paging is on (see paging, below)...
+#define VHEAPSIZE (256u << 20) // ...and how big it can get
+
+enum { PG_FREE, PG_USED, PG_HEAP, PG_SLAB, PG_BIG }; // page_t.kind: free, alloc_pages, the heap, a slab, a big malloc
+
+typedef struct slabobj {
+    struct slabobj* next;
+} slabobj_t;
+
+typedef struct page {
+    struct page* next; // the free list of its order, or its class' partial slab list
+    struct page* prev; // (only for the free lists)
+    slabobj_t* free; // slabs only: the free pieces
+    uint16_t inuse; // slabs only: pieces handed out (that includes ones sitting in the per-CPU caches below)
+    uint8_t cls; // slabs only: the size class
+    uint8_t owner; // slabs only: the CPU that set this slab up
+    uint8_t kind;
+    uint8_t order; // free or allocated blocks: the block's order (only set on its first page)
+    uint8_t dirty; // free or allocated blocks: has any of it ever been handed out? If not it's still all 0 (see calloc)
+    uint8_t zone;
+} page_t;
+
+typedef struct zone {
+    size_t first; // page number (address / PAGESIZE) of the first page, not counting the descriptor pages
+    uint32_t npages;
+    page_t* pages;
+    page_t* freeareas[MAXORDER + 1];
+    uint32_t* freemap[MAXORDER + 1]; // bit n of order o = the block at page (first >> o << o) + n * 2^o is free
+} zone_t;
+
+static zone_t zones[MAXZONES];
+static uint32_t nzones = 0;
+static page_t vheappage = { .kind = PG_HEAP }; // stands in for every page of the paged heap (it has no real descriptors)
+static int pagingon = 0;
+static volatile int pagelock = 0;
+static uint32_t pagestotal = 0, pagesfree = 0, pagespeak = 0; // (pagespeak = the most pages that were ever in use at once)
+
+static inline page_t* pageof(void* p) { // the descriptor of the page p is in, or NULL if it's not ours
+    size_t pfn = (size_t)p / PAGESIZE;
+    for (uint32_t i = 0; i < nzones; i++) {
+        if (pfn - zones[i].first < zones[i].npages) {
+            return &zones[i].pages[pfn - zones[i].first];
+        }
+    }
+    if (pagingon && (size_t)p - VHEAPBASE < VHEAPSIZE) {
+        return &vheappage;
+    }
+    return NULL;
+}
+
+static inline uint8_t* pageaddr(page_t* pg) {
+    zone_t* z = &zones[pg->zone];
+    return (uint8_t*)((z->first + (size_t)(pg - z->pages)) * PAGESIZE);
+}
+
+static inline int buddyisfree(zone_t* z, size_t pfn, uint32_t order) {
+    if (pfn < z->first || pfn + (1u << order) > z->first + z->npages) { // that buddy's not even in the zone
+        return 0;
     }
+    uint32_t bit = (pfn >> order) - (z->first >> order);
+    return (z->freemap[order][bit / 32] >> (bit % 32)) & 1;
+}
+
+static void buddypush(zone_t* z, size_t pfn, uint32_t order, uint32_t dirty) {
+    page_t* pg = &z->pages[pfn - z->first];
+    pg->kind = PG_FREE;
+    pg->order = (uint8_t)order;
+    pg->dirty = (uint8_t)dirty;
+    pg->prev = NULL;
+    pg->next = z->freeareas[order];
+    if (pg->next) {
+        pg->next->prev = pg;
+    }
+    z->freeareas[order] = pg;
+    uint32_t bit = (pfn >> order) - (z->first >> order);
+    z->freemap[order][bit / 32] |= 1u << (bit % 32);
+    pagesfree += 1u << order;
+}
+
+static void buddyunlink(zone_t* z, size_t pfn, uint32_t order) {
+    page_t* pg = &z->pages[pfn - z->first];
+    if (pg->prev) {
+        pg->prev->next = pg->next;
+    } else {
+        z->freeareas[order] = pg->next;
+    }
+    if (pg->next) {
+        pg->next->prev = pg->prev;
+    }
+    uint32_t bit = (pfn >> order) - (z->first >> order);
+    z->freemap[order][bit / 32] &= ~(1u << (bit % 32));
+    pagesfree -= 1u << order;
+}
+
+void* alloc_pages(uint32_t order) { // 2^order pages in one go, or NULL
+    spinlock(&pagelock);
+    for (uint32_t i = 0; i < nzones; i++) {
+        zone_t* z = &zones[i];
+        uint32_t o = order;
+        while (o <= MAXORDER && !z->freeareas[o]) { // the smallest free block that's big enough
+            o++;
+        }
+        if (o > MAXORDER) {
+            continue; // nothing here, try the next zone
+        }
+        page_t* pg = z->freeareas[o];
+        size_t pfn = z->first + (size_t)(pg - z->pages);
+        buddyunlink(z, pfn, o);
+        while (o > order) { // too big: split it in half, keep the front half and free the back half, until it fits
+            o--;
+            buddypush(z, pfn + (1u << o), o, pg->dirty);
+        }
+        pg->kind = PG_USED;
+        pg->order = (uint8_t)order;
+        if (pagestotal - pagesfree > pagespeak) {
+            pagespeak = pagestotal - pagesfree;
+        }
+        spinunlock(&pagelock);
+        return pageaddr(pg);
+    }
+    spinunlock(&pagelock);
+    return NULL;
+}
+
+void free_pages(void* addr, uint32_t order) {
+    page_t* pg = pageof(addr);
+    zone_t* z = &zones[pg->zone];
+    size_t pfn = (size_t)addr / PAGESIZE;
+    spinlock(&pagelock);
+    while (order < MAXORDER && buddyisfree(z, pfn ^ (1u << order), order)) { // buddy's free too: merge and go up
+        buddyunlink(z, pfn ^ (1u << order), order);
+        pfn &= ~(size_t)(1u << order);
+        order++;
+    }
+    buddypush(z, pfn, order, 1);
+    spinunlock(&pagelock);
+}
+
+/* Hands the pages from start to end to the buddy allocator, as a new zone. The zone's descriptors and bitmaps go in
+   its first pages. dirty says whether the memory might not be all 0s (see calloc) */
+static void zoneadd(size_t start, size_t end, uint32_t dirty) {
+    size_t first = (start + PAGESIZE - 1) / PAGESIZE, last = end / PAGESIZE;
+    if (nzones >= MAXZONES || last <= first) {
+        return;
+    }
+    uint32_t n = (uint32_t)(last - first), words[MAXORDER + 1], meta = n * sizeof(page_t);
+    for (uint32_t o = 0; o <= MAXORDER; o++) {
+        words[o] = (n >> o) / 32 + 2; // (+2: the first and last block of an order can be cut off by the zone's ends)
+        meta += words[o] * 4;
+    }
+    uint32_t metapages = (meta + PAGESIZE - 1) / PAGESIZE;
+    if (metapages + 1 >= n) {
+        return; // too small to bother
+    }
+
+    zone_t* z = &zones[nzones];
+    z->pages = (page_t*)(first * PAGESIZE);
+    memset(z->pages, 0, meta);
+    uint32_t* map = (uint32_t*)(z->pages + n);
+    for (uint32_t o = 0; o <= MAXORDER; o++) {
+        z->freemap[o] = map;
+        map += words[o];
+    }
+    z->first = first + metapages;
+    z->npages = n - metapages;
+    for (uint32_t i = 0; i < z->npages; i++) {
+        z->pages[i].zone = (uint8_t)nzones;
+    }
+
+    /* Cut it up into the biggest blocks that line up on their own size */
+    size_t pfn = z->first;
+    while (pfn < z->first + z->npages) {
+        uint32_t o = MAXORDER;
+        while (o && ((pfn & ((1u << o) - 1)) || pfn + (1u << o) > z->first + z->npages)) {
+            o--;
+        }
+        buddypush(z, pfn, o, dirty);
+        pfn += 1u << o;
+    }
+    pagestotal += z->npages;
+    nzones++;
+}
+
+/* Slabs! Almost everything we malloc is small (command lines, strings, little structs), and for those even the heap
+   below is more work than needed, and its header is a lot of waste. So small sizes get rounded up to a "size class" and come
+   from slabs instead: a slab is one page (4KB) chopped into equal pieces of one class. The free pieces of a slab are
+   kept in a list that lives inside the pieces themselves, so there's no header at all, and alloc/free is just
+   popping/pushing that list. Which slab (and so which size) a pointer belongs to we work out from its address.
+
+   Every slab is one page from alloc_pages, and its page_t doubles as the slab's bookkeeping. */
+#define SLABMAX 2048 // the biggest size a slab does, anything bigger goes to the heap
+#define NCLASSES 15
+#define HEAPORDER 4 // the heap gets pages 2^4 at a time (64KB)...
+#define BIGALLOC (4 * PAGESIZE) // ...and only takes what's smaller than this. Bigger ones get their own pages
+
+static const uint16_t classsize[NCLASSES] = { 8, 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048 };
+static uint8_t sizeclass[SLABMAX / 8 + 1]; // size (in 8 byte steps, rounded up) -> size class, filled in by init_memory_manager
+
+static page_t* slabpartial[NCLASSES]; // slabs with some free pieces left
+static volatile int slablock = 0;
+
+/* And a lock everyone fights over is slow too. So every CPU also keeps its own little stash ("cache") of free pieces,
+   one per size class. malloc and free of a small size just pop/push that CPU's own stash - no lock, and no memory
+   another CPU is touching. Only when a stash runs empty (or overflows) do we take the lock, and then we move a whole
+   bunch of pieces at once.
+
+   A piece freed by a different CPU than the one whose slab it's from goes back to that CPU, but not one at a time:
+   the freeing CPU collects REMOTEBATCH of them, then hands the whole batch over with one atomic operation. A batch that
+   never fills up would keep those pieces (and their slab pages) stuck forever though, so half-full batches go back too:
+   when a CPU finishes work it was given (runon), and as soon as the owner runs out and finds its inbox empty. */
+#define MAGSIZE 32 // the most pieces a CPU keeps per size class
+#define REMOTEBATCH 16
+
+typedef struct cpucache {
+    slabobj_t* head;
+    uint32_t count;
+} cpucache_t;
+
+typedef struct percpu {
+    struct percpu* self; // has to be first: thiscpu() reads it through the CPU's own segment
+    uint32_t id; // 0 for the CPU we booted on, then 1, 2, ...
+    uint32_t apicid; // what the local APIC calls this CPU
+    volatile int online;
+    void (*volatile work)(void); // something for this CPU to run (see runon)
+    cpucache_t cache[NCLASSES];
+    slabobj_t* remote[MAXCPUS]; // pieces we freed that belong to other CPUs, waiting to go back in a batch
+    uint32_t nremote[MAXCPUS];
+    slabobj_t* volatile inbox; // batches of our own pieces that other CPUs gave back
+    volatile int hungry; // we looked in the inbox and it was empty: send us what you've got, don't wait for a full batch
+    uint32_t nalloc, nfree, nfailed; // malloc statistics. Every CPU counts its own, meminfo adds them up
+    int32_t inuse; // bytes (this can go below 0 on one CPU, if it frees what another one allocated)
+} __attribute__((aligned(64))) percpu_t; // (64 = a cache line, so two CPUs' data never share one)
+
+static percpu_t percpu[MAXCPUS];
+static int percpuready = 0; // has percpuinit set up the per-CPU segments yet?
+
+static inline percpu_t* thiscpu() {
+    if (!percpuready) {
+        return &percpu[0];
+    }
+    percpu_t* c;
+    __asm__ ("mov %%gs:0, %0" : "=r"(c)); // every CPU's gs segment starts at its own percpu_t
+    return c;
+}
+
+/* The heap, for sizes too big for a slab but not worth whole pages. It's a "TLSF" (two-level segregated fit)
+   allocator: free blocks are sorted into lists by size - first by the power of two (the first level), then that
+   range cut into 16 slices (the second level) - and a bitmap says which lists have anything in them. So finding a
+   block that fits is two bitmap lookups with bsf, no matter how many free blocks there are.
+
+   Every block starts with a header, and a free block also leaves its size at its very end (its "footer", which is
+   the prevsize field of the next block's header). So when a block is freed, both its neighbours can be found straight
+   away and merged with it if they're free. */
+#define SLBITS 4 // 2^4 = 16 second level lists per power of two
+#define SLCOUNT (1 << SLBITS)
+#define HEAPALIGN 16 // every block's size is a multiple of this
+#define FLSHIFT (SLBITS + 4) // sizes below 2^8 all go in the first first-level list, in 16 byte steps
+#define FLCOUNT (30 - FLSHIFT + 1) // up to 1GB blocks
+#define BLOCKFREE 1 // (the low bits of block_header_t.size)
+#define PREVFREE 2
+#define BLOCKSIZE(b) ((b)->size & ~(size_t)(HEAPALIGN - 1))
+
+static struct {
+    uint32_t flmap; // bit n = something in slmap[n]
+    uint32_t slmap[FLCOUNT]; // bit n = something in lists[..][n]
+    block_header_t* lists[FLCOUNT][SLCOUNT];
+    size_t total, freebytes, peak; // (peak = the most that was ever in use at once, headers and all)
+    uint32_t nfreeblocks;
+} heap;
+
+static inline uint32_t bsf(uint32_t x) { // the lowest bit that's set (x can't be 0)
+    uint32_t r;
+    __asm__ ("bsf %1, %0" : "=r"(r) : "rm"(x));
+    return r;
+}
+
+static inline uint32_t bsr(uint32_t x) { // the highest bit that's set (x can't be 0)
+    uint32_t r;
+    __asm__ ("bsr %1, %0" : "=r"(r) : "rm"(x));
+    return r;
+}
+
+static inline block_header_t* nextphys(block_header_t* b) {
+    return (block_header_t*)((uint8_t*)(b + 1) + BLOCKSIZE(b));
+}
+
+static inline block_header_t* prevphys(block_header_t* b) { // (only if b->size has PREVFREE, otherwise the footer isn't there)
+    return (block_header_t*)((uint8_t*)b - b->prevsize - sizeof(block_header_t));
+}
+
+static void heapmapping(size_t size, uint32_t* fl, uint32_t* sl) { // which list a block of this size goes in
+    if (size < (1u << FLSHIFT)) {
+        *fl = 0;
+        *sl = size / HEAPALIGN;
+    } else {
+        uint32_t top = bsr(size);
+        *sl = (size >> (top - SLBITS)) ^ SLCOUNT; // the next 4 bits after the top one
+        *fl = top - FLSHIFT + 1;
+    }
+}
+
+static void heapinsert(block_header_t* b) {
+    uint32_t fl, sl;
+    heapmapping(BLOCKSIZE(b), &fl, &sl);
+    b->next = heap.lists[fl][sl];
+    b->prev = NULL;
+    if (b->next) {
+        b->next->prev = b;
+    }
+    heap.lists[fl][sl] = b;
+    heap.flmap |= 1u << fl;
+    heap.slmap[fl] |= 1u << sl;
+    heap.nfreeblocks++;
+    heap.freebytes += BLOCKSIZE(b) + sizeof(block_header_t);
+}
+
+static void heapremove(block_header_t* b) {
+    uint32_t fl, sl;
+    heapmapping(BLOCKSIZE(b), &fl, &sl);
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        heap.lists[fl][sl] = b->next;
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    }
+    if (!heap.lists[fl][sl]) {
+        heap.slmap[fl] &= ~(1u << sl);
+        if (!heap.slmap[fl]) {
+            heap.flmap &= ~(1u << fl);
+        }
+    }
+    heap.nfreeblocks--;
+    heap.freebytes -= BLOCKSIZE(b) + sizeof(block_header_t);
+}
+
+static void heapsetfree(block_header_t* b) { // marks b free and leaves its footer for the next block
+    b->size |= BLOCKFREE;
+    block_header_t* n = nextphys(b);
+    n->prevsize = BLOCKSIZE(b);
+    n->size |= PREVFREE;
+}
+
+// nothing from heapfresh up to heapfreshend has ever been handed out (or had a header written in it)
+static uint8_t* heapfresh = NULL;
+static uint8_t* heapfreshend = NULL;
+
+static void heapaddpool(void* mem, size_t bytes) { // gives the heap a chunk of memory to hand out
+    /* One big free block, and a 0 byte "used" block at the end so nothing ever tries to merge past it */
+    block_header_t* b = mem;
+    b->prevsize = 0;
+    b->size = (bytes - 2 * sizeof(block_header_t)) & ~(size_t)(HEAPALIGN - 1);
+    block_header_t* end = nextphys(b);
+    end->size = 0;
+    heap.total += bytes;
+    heapsetfree(b);
+    heapinsert(b);
+    if (!pageof(mem)->dirty && heapfresh == heapfreshend) { // all 0s (and we're not keeping track of another one)
+        heapfresh = (uint8_t*)(b + 1);
+        heapfreshend = (uint8_t*)end;
+    }
+}
+
+static int heapgrow() { // gets the heap more pages. Everything in them is marked as the heap's, so free can tell
+    if (pagingon) {
+        return 0; // (then the heap is all at VHEAPBASE, and it's already as big as it gets)
+    }
+    uint8_t* mem = alloc_pages(HEAPORDER);
+    if (!mem) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < (1u << HEAPORDER); i++) {
+        pageof(mem)[i].kind = PG_HEAP;
+    }
+    heapaddpool(mem, PAGESIZE << HEAPORDER);
+    return 1;
+}
+
+static inline void heaptouched(uint8_t* start, uint8_t* end) { // start..end is getting used (keeps heapfresh up to date)
+    if (start < heapfreshend && end > heapfresh) {
+        heapfresh = end < heapfreshend ? end : heapfreshend;
+    }
+}
+
+static void heaptrim(block_header_t* b, size_t size) { // gives back the end of b after size bytes, if that's worth it
+    if (BLOCKSIZE(b) >= size + sizeof(block_header_t) + HEAPALIGN) {
+        block_header_t* rest = (block_header_t*)((uint8_t*)(b + 1) + size);
+        rest->size = BLOCKSIZE(b) - size - sizeof(block_header_t);
+        b->size = size | (b->size & PREVFREE);
+        block_header_t* n = nextphys(rest);
+        if (n->size & BLOCKFREE) { // (can happen after heapalignalloc moved b up)
+            heapremove(n);
+            rest->size += BLOCKSIZE(n) + sizeof(block_header_t);
+        }
+        heapsetfree(rest);
+        heapinsert(rest);
+    }
+}
+
+// (this is the shared heap, so hold heaplock when calling it)
+static void* heapalloc(size_t size) {
+    size = size < HEAPALIGN ? HEAPALIGN : (size + HEAPALIGN - 1) & ~(size_t)(HEAPALIGN - 1);
+
+    /* Round up to the next list boundary, so any block in the list we pick is big enough ("good fit"),
+       then look in that list and, if it's empty, in the next non-empty one up */
+    size_t want = size;
+    if (want >= (1u << FLSHIFT)) {
+        want += (1u << (bsr(want) - SLBITS)) - 1;
+    }
+    uint32_t fl, sl;
+    heapmapping(want, &fl, &sl);
+    if (fl >= FLCOUNT) {
+        return NULL;
+    }
+    uint32_t slmap = heap.slmap[fl] & (~0u << sl);
+    if (!slmap) {
+        uint32_t flmap = fl + 1 < FLCOUNT ? heap.flmap & (~0u << (fl + 1)) : 0;
+        if (!flmap) { // nothing big enough: get more pages and try again
+            if (want + 2 * sizeof(block_header_t) > (PAGESIZE << HEAPORDER) || !heapgrow()) {
+                return NULL; // No memory available
+            }
+            return heapalloc(size);
+        }
+        fl = bsf(flmap);
+        slmap = heap.slmap[fl];
+    }
+    block_header_t* b = heap.lists[fl][bsf(slmap)];
+    heapremove(b);
+
+    b->size &= ~(size_t)BLOCKFREE;
+    nextphys(b)->size &= ~(size_t)PREVFREE;
+    heaptrim(b, size); // cut off what we don't need, if it's big enough to be a block of its own
+    heaptouched((uint8_t*)b, (uint8_t*)(b + 1) + size + sizeof(block_header_t)); // (+ header: heaptrim may have put one there)
+    if (heap.total - heap.freebytes > heap.peak) {
+        heap.peak = heap.total - heap.freebytes;
+    }
+    return (void*)(b + 1);
+}
+
+
+static void heapfree(void* ptr) { // (hold heaplock for this one too)
+    block_header_t* b = (block_header_t*)ptr - 1;
+
+    if (b->size & PREVFREE) { // merge with the block before
+        block_header_t* p = prevphys(b);
+        heapremove(p);
+        p->size += BLOCKSIZE(b) + sizeof(block_header_t);
+        b = p;
+    }
+    block_header_t* n = nextphys(b);
+    if (n->size & BLOCKFREE) { // and the one after
+        heapremove(n);
+        b->size += BLOCKSIZE(n) + sizeof(block_header_t);
+    }
+    heapsetfree(b);
+    heapinsert(b);
+}
+
+static void* heapalignalloc(size_t align, size_t size) { // like heapalloc, but the data starts at a multiple of align
+    /* Get enough that there's an aligned spot in there with room for a free block in front of it, then give that
+       front part (and whatever's left at the end) back */
+    size = (size + HEAPALIGN - 1) & ~(size_t)(HEAPALIGN - 1);
+    uint8_t* p = heapalloc(size + align + sizeof(block_header_t) + HEAPALIGN);
+    if (!p) {
+        return NULL;
+    }
+    block_header_t* b = (block_header_t*)p - 1;
+    uint8_t* aligned = (uint8_t*)(((size_t)p + align - 1) & ~(align - 1));
+    if (aligned != p) {
+        while ((size_t)(aligned - p) < sizeof(block_header_t) + HEAPALIGN) { // too close to be a block of its own
+            aligned += align;
+        }
+        block_header_t* nb = (block_header_t*)aligned - 1;
+        nb->size = BLOCKSIZE(b) - (aligned - p);
+        b->size = (aligned - p - sizeof(block_header_t)) | (b->size & PREVFREE);
+        heapfree(p); // (that also marks nb's PREVFREE and leaves the footer)
+        b = nb;
+    }
+    heaptrim(b, size);
+    return aligned;
+}
+
+static int heapresize(void* ptr, size_t size) { // tries to make a heap block size bytes without moving it
+    block_header_t* b = (block_header_t*)ptr - 1;
+    if (size >= BIGALLOC) { // not the heap's to give (this also keeps the rounding up from wrapping past 0)
+        return 0;
+    }
+    size = size < HEAPALIGN ? HEAPALIGN : (size + HEAPALIGN - 1) & ~(size_t)(HEAPALIGN - 1);
+    if (size > BLOCKSIZE(b)) { // growing: only if the next block is free and big enough to make up the difference
+        block_header_t* n = nextphys(b);
+        if (!(n->size & BLOCKFREE) || BLOCKSIZE(b) + sizeof(block_header_t) + BLOCKSIZE(n) < size) {
+            return 0;
+        }
+        heapremove(n);
+        b->size += sizeof(block_header_t) + BLOCKSIZE(n);
+        nextphys(b)->size &= ~(size_t)PREVFREE;
+        heaptouched((uint8_t*)b, (uint8_t*)ptr + size + sizeof(block_header_t));
+    }
+    heaptrim(b, size); // and give back what's left over (or what shrinking freed up)
+    if (heap.total - heap.freebytes > heap.peak) {
+        heap.peak = heap.total - heap.freebytes;
+    }
+    return 1;
+}
+
+/* Paging! So far every address is the real ("physical") address in RAM. With paging on, the CPU looks every address
+   up in a table first (the page directory, which points to page tables), which can point anywhere - or nowhere, and
+   then the CPU stops and asks us (a "page fault", exception 14).
+
+   We use it for two things:
+   - RAM and the devices keep their own addresses ("identity mapped"), with 4MB pages straight from the page
+     directory ("PSE"). Far fewer entries for the CPU to cache (in the TLB) than with 4KB pages. Only the first 4MB
+     gets 4KB pages, so VGA memory and the BIOS under 1MB can be left uncached without slowing the kernel down.
+   - The heap gets 256MB of addresses at VHEAPBASE, but no memory behind them. The first time something touches one
+     of its pages, the page fault handler gets a free page, clears it and maps it in. So the heap is huge from the
+     start, but only takes up the RAM it has really used. */
+#ifndef KRNL_HOSTED
+#define PTE_PRESENT 0x01
+#define PTE_WRITE 0x02
+#define PTE_NOCACHE 0x18 // (write through + cache disable, for device memory)
+#define PDE_4MB 0x80
+#define PTE_GLOBAL 0x100 // the same for every program (not that we have any), so it stays in the TLB
+
+static uint32_t pagedir[1024] __attribute__((aligned(4096)));
+static uint32_t lowpt[1024] __attribute__((aligned(4096))); // the first 4MB, in 4KB pages
+static volatile int vmlock = 0;
+
+static void pagefault(regs_t* r) {
+    uint32_t addr;
+    __asm__ __volatile__ ("mov %%cr2, %0" : "=r"(addr)); // the address it was trying to get at
+    if (!(r->err & 1) && addr - VHEAPBASE < VHEAPSIZE) { // nothing there yet, and it's the heap: give it a page
+        spinlock(&vmlock); // (another CPU might be doing the same page)
+        uint32_t* pde = &pagedir[addr >> 22];
+        if (!(*pde & PTE_PRESENT)) {
+            uint32_t* pt = alloc_pages(0);
+            if (!pt) {
+                goto oom;
+            }
+            if (pageof(pt)->dirty) {
+                memset(pt, 0, PAGESIZE);
+            }
+            *pde = (uint32_t)pt | PTE_PRESENT | PTE_WRITE;
+        }
+        uint32_t* pte = (uint32_t*)(*pde & ~0xFFFu) + ((addr >> 12) & 1023);
+        if (!(*pte & PTE_PRESENT)) {
+            uint8_t* frame = alloc_pages(0);
+            if (!frame) {
+                goto oom;
+            }
+            if (pageof(frame)->dirty) { // (never used pages are 0s already)
+                memset(frame, 0, PAGESIZE);
+            }
+            *pte = (uint32_t)frame | PTE_PRESENT | PTE_WRITE;
+        }
+        spinunlock(&vmlock);
+        return;
+    oom:
+        puts("\nOut of memory for the heap!");
+    }
+    kprintf("\nPAGE FAULT at 0x%08X (eip 0x%08X). Halting.\n", addr, r->eip);
+    while (1) {
+        __asm__ __volatile__ ("cli; hlt");
+    }
+}
+
+static void pagingenable() { // every CPU has to do this for itself
+    uint32_t cr;
+    __asm__ __volatile__ ("mov %%cr4, %0" : "=r"(cr));
+    cr |= 0x10 | 0x80; // PSE (4MB pages) and PGE (global pages)
+    __asm__ __volatile__ ("mov %0, %%cr4" : : "r"(cr));
+    __asm__ __volatile__ ("mov %0, %%cr3" : : "r"(pagedir) : "memory");
+    dftss.cr3 = (uint32_t)pagedir; // (the double fault task needs the same page tables)
+    __asm__ __volatile__ ("mov %%cr0, %0" : "=r"(cr));
+    cr |= 0x80000000u; // and on it goes
+    __asm__ __volatile__ ("mov %0, %%cr0" : : "r"(cr) : "memory");
+}
+
+static void paginginit() {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & (1 << 3)) || !(d & (1 << 13))) { // no 4MB or global pages (very old CPU): no paging, the heap uses pages
+        return;
+    }
+
+    /* Map all the RAM we've got (and whatever's between it), and everything above the heap (that's where the devices,
+       like the local APIC, are) */
+    uint32_t top = 0;
+    for (uint32_t i = 0; i < nzones; i++) {
+        if ((zones[i].first + zones[i].npages) * PAGESIZE > top) {
+            top = (zones[i].first + zones[i].npages) * PAGESIZE;
+        }
+    }
+    for (uint32_t i = 0; i < 1024; i++) { // the first 4MB has the VGA memory and the BIOS in it, which mustn't be cached
+        lowpt[i] = (i << 12) | PTE_GLOBAL | PTE_WRITE | PTE_PRESENT;
+        if (i << 12 >= 0xA0000 && i << 12 < 0x100000) {
+            lowpt[i] |= PTE_NOCACHE;
+        }
+    }
+    pagedir[0] = (uint32_t)lowpt | PTE_WRITE | PTE_PRESENT;
+    for (uint32_t i = 1; i < (top + (1u << 22) - 1) >> 22 && i < VHEAPBASE >> 22; i++) {
+        pagedir[i] = (i << 22) | PDE_4MB | PTE_GLOBAL | PTE_WRITE | PTE_PRESENT;
+    }
+    for (uint32_t i = (VHEAPBASE + VHEAPSIZE) >> 22; i < 1024; i++) {
+        pagedir[i] = (i << 22) | PDE_4MB | PTE_GLOBAL | PTE_NOCACHE | PTE_WRITE | PTE_PRESENT;
+    }
+
+    irqhandlers[14] = pagefault;
+    pagingenable();
+    pagingon = 1;
+}
+#endif
+
+/* Which memory can we use? GRUB (or any other multiboot loader) tells us: it leaves a magic number in eax and the
+   address of a "multiboot info" structure in ebx, which your boot code should pass on to krnlMain (push ebx, push eax,
+   call krnlMain). In there is the BIOS's memory map: a list of pieces of RAM, and which ones are free to use. Every
+   usable one becomes a zone, minus the bits that are already taken: the first 1MB (BIOS stuff, the VGA memory, the SMP
+   trampoline), our kernel itself, any modules GRUB loaded, and the info structure we're reading. */
+#define MB1MAGIC 0x2BADB002 // multiboot 1
+#define MB2MAGIC 0x36D76289 // multiboot 2
+#define BOOTPOOL (128 * 1024) // a little bit of memory in the kernel itself, in case there's no memory map
+#define MAXRESERVED 16
+
+extern char _end[] __attribute__((weak)); // the end of the kernel, if the linker script says so (most do)
+
+static uint8_t bootpool[BOOTPOOL] __attribute__((aligned(4096)));
+static uint64_t reserved[MAXRESERVED][2]; // start and end of things that are in RAM, but not ours to hand out
+static uint32_t nreserved = 0;
+static uint64_t ram[MAXZONES][2]; // base and length of the usable pieces of RAM
+static uint32_t nram = 0;
+
+static void reserve(uint64_t start, uint64_t end) {
+    if (nreserved < MAXRESERVED) {
+        reserved[nreserved][0] = start;
+        reserved[nreserved][1] = end;
+        nreserved++;
+    }
+}
+
+static void ramfound(uint64_t base, uint64_t len) {
+    if (nram < MAXZONES) {
+        ram[nram][0] = base;
+        ram[nram][1] = len;
+        nram++;
+    }
+}
+
+static void ramadd(uint64_t start, uint64_t end, uint32_t from) { // adds start..end as zones, minus reserved[from..]
+#ifndef KRNL_HOSTED // (the hosted build's "RAM" is wherever mmap put it, and there's no paged heap to get in the way of)
+    if (start >= VHEAPBASE) {
+        return; // we're 32 bit, so there's only 4GB of addresses, and from here up they're for the heap and devices
+    }
+    if (end > VHEAPBASE) {
+        end = VHEAPBASE;
+    }
+#endif
+    for (uint32_t i = from; i < nreserved; i++) {
+        if (reserved[i][0] < end && reserved[i][1] > start) { // in the way: do the bits on either side of it instead
+            if (start < reserved[i][0]) {
+                ramadd(start, reserved[i][0], i + 1);
+            }
+            if (end > reserved[i][1]) {
+                ramadd(reserved[i][1], end, i + 1);
+            }
+            return;
+        }
+    }
+    zoneadd((size_t)start, (size_t)end, 1); // (RAM isn't all 0s when we get it, unlike the bss)
+}
+
+static uint32_t elfend(uint32_t* sh, uint32_t num, uint32_t entsize) { // where the kernel ends, from its ELF section headers
+    uint32_t end = 0;
+    for (uint32_t i = 0; i < num; i++, sh = (uint32_t*)((uint8_t*)sh + entsize)) {
+        if ((sh[2] & 2) && sh[3] + sh[5] > end) { // a section that's loaded into memory (flags & SHF_ALLOC): addr + size
+            end = sh[3] + sh[5];
+        }
+    }
+    return end;
+}
+
+static void multiboot(uint32_t magic, uint32_t* info) { // reads the memory map into ram[], and what to skip into reserved[]
+    size_t kend = (size_t)_end;
+    uint32_t upper = 0;
+    if (magic == MB1MAGIC) {
+        uint32_t flags = info[0];
+        reserve((size_t)info, (size_t)info + 88);
+        if (flags & 1) {
+            upper = info[2]; // KB of memory above 1MB
+        }
+        if (flags & (1 << 3)) { // modules
+            uint32_t* mod = (uint32_t*)(size_t)info[6];
+            reserve(info[6], info[6] + info[5] * 16);
+            for (uint32_t i = 0; i < info[5]; i++, mod += 4) {
+                reserve(mod[0], mod[1]);
+            }
+        }
+        if (!kend && (flags & (1 << 5))) {
+            kend = elfend((uint32_t*)(size_t)info[9], info[7], info[8]);
+        }
+        if (flags & (1 << 6)) { // the memory map: entries of size, base, length, type (1 = usable)
+            reserve(info[12], info[12] + info[11]);
+            for (uint8_t* e = (uint8_t*)(size_t)info[12]; e < (uint8_t*)(size_t)info[12] + info[11]; e += *(uint32_t*)e + 4) {
+                uint32_t* m = (uint32_t*)e;
+                if (m[5] == 1) {
+                    ramfound(m[1] | (uint64_t)m[2] << 32, m[3] | (uint64_t)m[4] << 32);
+                }
+            }
+        }
+    } else if (magic == MB2MAGIC) { // multiboot 2 is a list of "tags" instead: type, size, then whatever that type has
+        reserve((size_t)info, (size_t)info + info[0]);
+        for (uint32_t* tag = info + 2; tag[0]; tag = (uint32_t*)((uint8_t*)tag + ((tag[1] + 7) & ~7u))) {
+            if (tag[0] == 3) { // a module
+                reserve(tag[2], tag[3]);
+            } else if (tag[0] == 4) { // the basic memory info
+                upper = tag[3];
+            } else if (tag[0] == 9 && !kend) { // the ELF section headers
+                kend = elfend(tag + 5, tag[2], tag[3]);
+            } else if (tag[0] == 6) { // the memory map: entries of base, length, type (1 = usable)
+                for (uint8_t* e = (uint8_t*)(tag + 4); e < (uint8_t*)tag + tag[1]; e += tag[2]) {
+                    uint32_t* m = (uint32_t*)e;
+                    if (m[4] == 1) {
+                        ramfound(m[0] | (uint64_t)m[1] << 32, m[2] | (uint64_t)m[3] << 32);
+                    }
+                }
+            }
+        }
+    }
+
+    if (!kend) { // no idea where the kernel ends, so we can't safely use anything
+        nram = 0;
+        return;
+    }
+    if (!nram && upper) { // no map, but at least we know how much there is above 1MB
+        ramfound(0x100000, (uint64_t)upper * 1024);
+    }
+    reserve(0, kend); // the first 1MB and the kernel (which GRUB loads at 1MB or above)
+}
+
+// Initialize memory manager
+void init_memory_manager(uint32_t magic, uint32_t* info) {
+    zoneadd((size_t)bootpool, (size_t)bootpool + BOOTPOOL, 0); // this one's in the bss, so all 0 (see calloc)
+    multiboot(magic, info);
+    for (uint32_t i = 0; i < nram; i++) {
+        ramadd(ram[i][0], ram[i][0] + ram[i][1], 0);
+    }
+#ifndef KRNL_HOSTED
+    paginginit();
+#endif
+    if (pagingon) { // one huge heap, filled in as it's used (without paging, heapgrow adds pages as they're needed)
+        heapaddpool((void*)VHEAPBASE, VHEAPSIZE);
+    }
+
+    uint8_t cls = 0;
+    for (size_t i = 0; i <= SLABMAX / 8; i++) {
+        if (i * 8 > classsize[cls]) {
+            cls++;
+        }
+        sizeclass[i] = cls;
+    }
+}
+
+static page_t* slabnew(uint32_t cls, uint32_t owner) { // gets a page and makes it a slab of class cls (hold slablock)
+    uint8_t* page = alloc_pages(0);
+    if (!page) {
+        return NULL;
+    }
+    page_t* s = pageof(page);
+
+    /* Chain all the pieces together, back to front so the list comes out in address order */
+    uint32_t size = classsize[cls];
+    s->free = NULL;
+    for (int i = PAGESIZE / size - 1; i >= 0; i--) {
+        slabobj_t* o = (slabobj_t*)(page + i * size);
+        o->next = s->free;
+        s->free = o;
+    }
+    s->kind = PG_SLAB;
+    s->inuse = 0;
+    s->cls = (uint8_t)cls;
+    s->owner = (uint8_t)owner;
+    s->next = slabpartial[cls];
+    slabpartial[cls] = s;
+    return s;
+}
+
+static void slabput(slabobj_t* o) { // gives a piece back to its slab (hold slablock)
+    page_t* s = pageof(o);
+    if (!s->free) { // it was full, so it's not in the partial list: it is now
+        s->next = slabpartial[s->cls];
+        slabpartial[s->cls] = s;
+    }
+    o->next = s->free;
+    s->free = o;
+
+    if (--s->inuse == 0) { // completely empty, hand the page back so anyone can use it
+        page_t** pp = &slabpartial[s->cls];
+        while (*pp != s) {
+            pp = &(*pp)->next;
+        }
+        *pp = s->next;
+        free_pages(pageaddr(s), 0);
+    }
+}
+
+static void cacheflush(cpucache_t* cache, uint32_t keep) { // gives all but keep pieces of a stash back to their slabs
+    spinlock(&slablock);
+    while (cache->count > keep) {
+        slabobj_t* o = cache->head;
+        cache->head = o->next;
+        cache->count--;
+        slabput(o);
+    }
+    spinunlock(&slablock);
+}
+
+static void cachepush(percpu_t* c, slabobj_t* o) {
+    cpucache_t* cache = &c->cache[pageof(o)->cls];
+    if (cache->count >= MAGSIZE) { // too many, give half back in one go
+        cacheflush(cache, MAGSIZE / 2);
+    }
+    o->next = cache->head;
+    cache->head = o;
+    cache->count++;
+}
+
+static void sendremote(percpu_t* c, uint32_t owner) { // hands a batch of pieces back to the CPU they belong to
+    slabobj_t* head = c->remote[owner];
+    slabobj_t* tail = head;
+    while (tail->next) {
+        tail = tail->next;
+    }
+    percpu_t* o = &percpu[owner];
+    slabobj_t* old;
+    do { // put our chain in front of whatever is already in their inbox, unless someone beat us to it (then retry)
+        old = o->inbox;
+        tail->next = old;
+    } while (!__sync_bool_compare_and_swap(&o->inbox, old, head));
+    c->remote[owner] = NULL;
+    c->nremote[owner] = 0;
+}
+
+static void remoteflush(percpu_t* c, int all) { // sends back the batches that aren't full yet (all, or just to hungry CPUs)
+    for (uint32_t owner = 0; owner < MAXCPUS; owner++) {
+        if (c->nremote[owner] && (all || percpu[owner].hungry)) {
+            sendremote(c, owner);
+        }
+    }
+}
+
+static void cacherefill(percpu_t* c, uint32_t cls) {
+    /* First, take back whatever other CPUs returned to us (one atomic swap grabs every batch at once) */
+    slabobj_t* o = __sync_lock_test_and_set(&c->inbox, NULL);
+    c->hungry = !o;
+    remoteflush(c, 0); // (and while we're on the slow path, send back what other hungry CPUs are waiting for)
+    while (o) {
+        slabobj_t* next = o->next;
+        cachepush(c, o);
+        o = next;
+    }
+    if (c->cache[cls].head) {
+        return;
+    }
+
+    /* Still nothing, so get half a stash worth from the slabs while we hold the lock. Slabs we make now are ours,
+       slabs other CPUs made we can still take pieces from */
+    cpucache_t* cache = &c->cache[cls];
+    spinlock(&slablock);
+    while (cache->count < MAGSIZE / 2) {
+        page_t* s = slabpartial[cls];
+        if (!s && !(s = slabnew(cls, c->id))) {
+            break;
+        }
+        o = s->free;
+        s->free = o->next;
+        s->inuse++;
+        if (!s->free) { // full now, off the partial list
+            slabpartial[cls] = s->next;
+        }
+        o->next = cache->head;
+        cache->head = o;
+        cache->count++;
+    }
+    spinunlock(&slablock);
+}
+
+static size_t blocksize(void* p) { // how big the block p got really is
+    page_t* pg = pageof(p);
+    if (pg->kind == PG_SLAB) {
+        return classsize[pg->cls];
+    }
+    if (pg->kind == PG_HEAP) {
+        return BLOCKSIZE((block_header_t*)p - 1);
+    }
+    return (size_t)PAGESIZE << pg->order;
+}
+
+static uint32_t lastfailed = 0; // the size of the last malloc that came back NULL
+
+static inline void memcount(void* p, size_t size) { // statistics for meminfo, for every block handed out (or not)
+    percpu_t* c = thiscpu();
+    if (p) {
+        c->nalloc++;
+        c->inuse += blocksize(p);
+    } else {
+        c->nfailed++;
+        lastfailed = size;
+    }
+}
+
+static void* slaballoc(uint32_t cls) { // a piece of class cls from this CPU's own stash
+    percpu_t* c = thiscpu();
+    cpucache_t* cache = &c->cache[cls];
+    if (!cache->head) {
+        cacherefill(c, cls);
+    }
+    slabobj_t* o = cache->head;
+    if (o) {
+        cache->head = o->next;
+        cache->count--;
+    }
+    return o;
+}
+
+static void* bigalloc(size_t size, size_t align) { // whole pages of its own, so it doesn't chop up the heap
+    if (size > (size_t)PAGESIZE << MAXORDER || align > (size_t)PAGESIZE << MAXORDER) { // more than the biggest block
+        return NULL; // (and on 32 bits PAGESIZE << order runs out at 4GB, so the loop below wouldn't stop for it)
+    }
+    uint32_t order = 0;
+    while ((size_t)PAGESIZE << order < size || (size_t)PAGESIZE << order < align) { // (buddy blocks are aligned to their size)
+        order++;
+    }
+    void* p = alloc_pages(order);
+    if (p) {
+        pageof(p)->kind = PG_BIG;
+    }
+    return p;
+}
+
+/* Everything malloc gives back is "naturally aligned": slab pieces sit at multiples of their size in a page (so 16
+   byte pieces are 16 byte aligned, 64 byte ones 64 byte aligned...), heap blocks are 16 byte aligned, big ones page
+   aligned. Only sizes of 8 or less can come back just 8 byte aligned, which is all they need. */
+void* malloc(size_t size) {
+    void* p;
+    if (size <= SLABMAX) {
+        p = slaballoc(sizeclass[(size + 7) / 8]);
+    } else if (size < BIGALLOC) {
+        spinlock(&heaplock);
+        p = heapalloc(size);
+        spinunlock(&heaplock);
+    } else {
+        p = bigalloc(size, 0);
+    }
+    memcount(p, size);
+    trace(TR_MALLOC, size, (uint32_t)(size_t)p);
+    return p;
+}
+
+/* For when you need more than that: 64 bytes for a cache line, 4096 for a page... align has to be a power of two.
+   free() works on these like on anything else. */
+void* aligned_alloc(size_t align, size_t size) {
+    if (!align || (align & (align - 1))) {
+        return NULL;
+    }
+    if (align <= HEAPALIGN) {
+        return malloc(size < align ? align : size);
+    }
+
+    void* p;
+    if (size <= SLABMAX && align <= SLABMAX) { // the first size class that's a multiple of align will do
+        uint32_t cls = sizeclass[((size < align ? align : size) + 7) / 8];
+        while (classsize[cls] % align) {
+            cls++;
+        }
+        p = slaballoc(cls);
+    } else if (size < BIGALLOC && align < PAGESIZE) {
+        spinlock(&heaplock);
+        p = heapalignalloc(align, size);
+        spinunlock(&heaplock);
+    } else {
+        p = bigalloc(size, align);
+    }
+    memcount(p, size);
+    trace(TR_MALLOC, size, (uint32_t)(size_t)p);
+    return p;
+}
+
+void* memalign(size_t align, size_t size) { // (the older name for the same thing)
+    return aligned_alloc(align, size);
+}
+
+
+void free(void* ptr) {
+    if (!ptr) return;
+    trace(TR_FREE, (uint32_t)(size_t)ptr, 0);
+    thiscpu()->nfree++;
+    thiscpu()->inuse -= blocksize(ptr);
+
+    page_t* s = pageof(ptr);
+    if (s->kind == PG_HEAP) {
+        spinlock(&heaplock);
+        heapfree(ptr);
+        spinunlock(&heaplock);
+        return;
+    }
+    if (s->kind == PG_BIG) {
+        free_pages(ptr, s->order);
+        return;
+    }
+
+    percpu_t* c = thiscpu();
+    uint32_t owner = s->owner;
+    slabobj_t* o = ptr;
+    if (owner == c->id) {
+        cachepush(c, o);
+        return;
+    }
+    o->next = c->remote[owner]; // somebody else's piece: save it up for them
+    c->remote[owner] = o;
+    if (++c->nremote[owner] >= REMOTEBATCH || percpu[owner].hungry) {
+        sendremote(c, owner);
+    }
+}
+
+/* Makes ptr's block size bytes big. If it can, it keeps the block where it is: a slab piece that still fits its size
+   class, a heap block that can swallow the free block after it (or give back its end), whole pages that can give back
+   their back halves. Only otherwise does it get a new block and copy. */
+void* realloc(void* ptr, size_t size) {
+    if (!ptr) {
+        return malloc(size);
+    }
+    if (!size) {
+        free(ptr);
+        return NULL;
+    }
+    if (size > (size_t)PAGESIZE << MAXORDER) { // nothing could hold it (ptr stays as it was, like when malloc fails)
+        return NULL;
+    }
+
+    page_t* pg = pageof(ptr);
+    size_t have;
+    thiscpu()->inuse -= blocksize(ptr); // (and back, with whatever size it ends up, wherever it ends up)
+    if (pg->kind == PG_SLAB) {
+        have = classsize[pg->cls];
+        if (size <= have && size > have / 2) { // (much smaller is worth moving to a smaller class)
+            thiscpu()->inuse += have;
+            return ptr;
+        }
+    } else if (pg->kind == PG_HEAP) {
+        spinlock(&heaplock);
+        int done = heapresize(ptr, size);
+        have = BLOCKSIZE((block_header_t*)ptr - 1);
+        spinunlock(&heaplock);
+        if (done) {
+            thiscpu()->inuse += have;
+            return ptr;
+        }
+    } else {
+        uint32_t order = pg->order;
+        have = (size_t)PAGESIZE << order;
+        if (size <= have) {
+            while (order > 0 && (size_t)PAGESIZE << (order - 1) >= size) { // the back half isn't needed, free it
+                order--;
+                free_pages((uint8_t*)ptr + (PAGESIZE << order), order);
+            }
+            pg->order = (uint8_t)order;
+            thiscpu()->inuse += (size_t)PAGESIZE << order;
+            return ptr;
+        }
+    }
+
+    thiscpu()->inuse += have;
+    void* n = malloc(size);
+    if (n) {
+        memcpy(n, ptr, size < have ? size : have);
+        free(ptr);
+    }
+    return n;
+}
+
+/* malloc, but all 0s. The pool is in the bss, so it starts out all 0: whole pages that were never handed out, and the
+   part of the heap that was never used, don't need clearing. */
+void* calloc(size_t count, size_t size) {
+    size_t total = count * size;
+    if (size && total / size != count) { // too big to even count
+        return NULL;
+    }
+
+    void* p;
+    if (total <= SLABMAX) { // (small anyway, and the free list pointers were in there)
+        p = malloc(total);
+        if (p) {
+            memset(p, 0, total);
+        }
+    } else if (total < BIGALLOC) {
+        spinlock(&heaplock);
+        uint8_t* fresh = heapfresh;
+        uint8_t* freshend = heapfreshend;
+        p = heapalloc(total);
+        spinunlock(&heaplock);
+        memcount(p, total);
+        trace(TR_MALLOC, total, (uint32_t)(size_t)p);
+        if (p && ((uint8_t*)p < fresh || (uint8_t*)p >= freshend)) { // only what's outside fresh..freshend needs it
+            memset(p, 0, (uint8_t*)p < fresh && (uint8_t*)p + total > fresh ? (size_t)(fresh - (uint8_t*)p) : total);
+        }
+    } else {
+        p = bigalloc(total, 0);
+        memcount(p, total);
+        trace(TR_MALLOC, total, (uint32_t)(size_t)p);
+        if (p && pageof(p)->dirty) {
+            memset(p, 0, total);
+        }
+    }
+    return p;
+}
+
+/* When malloc starts saying no, this tells you why: if there's plenty free but the biggest free block is small,
+   memory's in too many little pieces ("fragmented"). If there's just not much free, it's full. */
+static size_t heaplargest(uint32_t* hist) { // the heap's biggest free block (and, into hist, how many of each power of two)
+    size_t largest = 0;
+    spinlock(&heaplock);
+    for (size_t fl = 0; fl < FLCOUNT; fl++) {
+        for (size_t sl = 0; sl < SLCOUNT; sl++) {
+            for (block_header_t* b = heap.lists[fl][sl]; b; b = b->next) {
+                if (hist) {
+                    hist[bsr(BLOCKSIZE(b))]++;
+                }
+                if (BLOCKSIZE(b) > largest) {
+                    largest = BLOCKSIZE(b);
+                }
+            }
+        }
+    }
+    spinunlock(&heaplock);
+    return largest;
+}
+
+void meminfo() {
+    uint32_t nalloc = 0, nfree = 0, nfailed = 0;
+    int32_t inuse = 0;
+    for (size_t i = 0; i < MAXCPUS; i++) {
+        nalloc += percpu[i].nalloc;
+        nfree += percpu[i].nfree;
+        nfailed += percpu[i].nfailed;
+        inuse += percpu[i].inuse;
+    }
+    kprintf("malloc: %u allocs, %u frees, %u failed", nalloc, nfree, nfailed);
+    if (nfailed) {
+        kprintf(" (last: %u bytes)", lastfailed);
+    }
+    kprintf(", %d bytes in use", inuse);
+
+    /* The pages, and how many free blocks of each size the buddy allocator has */
+    uint32_t counts[MAXORDER + 1];
+    spinlock(&pagelock);
+    uint32_t freepages = pagesfree, peak = pagespeak, biggest = 0;
+    for (uint32_t o = 0; o <= MAXORDER; o++) {
+        counts[o] = 0;
+        for (uint32_t z = 0; z < nzones; z++) {
+            for (page_t* pg = zones[z].freeareas[o]; pg; pg = pg->next) {
+                counts[o]++;
+                biggest = o;
+            }
+        }
+    }
+    spinunlock(&pagelock);
+    for (uint32_t z = 0; z < nzones; z++) {
+        kprintf("\nzone %u: %p, %uKB", z, (void*)(zones[z].first * PAGESIZE), zones[z].npages * (PAGESIZE / 1024));
+    }
+    kprintf("\npages: %u of %u used (peak %u), biggest free block %uKB\n  free blocks:", pagestotal - freepages,
+            pagestotal, peak, freepages ? (PAGESIZE / 1024) << biggest : 0);
+    for (uint32_t o = 0; o <= MAXORDER; o++) {
+        if (counts[o]) {
+            kprintf(" %uKBx%u", (PAGESIZE / 1024) << o, counts[o]);
+        }
+    }
+
+    /* The heap, and its free blocks by power of two (the first level lists, near enough) */
+    uint32_t hist[32];
+    for (size_t i = 0; i < 32; i++) {
+        hist[i] = 0;
+    }
+    size_t largest = heaplargest(hist);
+    size_t total = heap.total, freebytes = heap.freebytes, hpeak = heap.peak;
+    uint32_t nblocks = heap.nfreeblocks;
+    kprintf("\nheap: %zuKB of %zuKB used (peak %zuKB), %u free blocks, biggest %zu bytes", (total - freebytes) / 1024,
+            total / 1024, hpeak / 1024, nblocks, largest);
+    if (freebytes) {
+        kprintf(" (%zu%% fragmented)", 100 - largest * 100 / freebytes);
+    }
+    puts("\n  free blocks:");
+    for (size_t i = 0; i < 32; i++) {
+        if (hist[i]) {
+            kprintf(" %u+ x%u", 1u << i, hist[i]);
+        }
+    }
+}
+
+
+/* Scratch memory: most of what a command allocates (its arguments, bits of text it's putting together...) is garbage
+   the moment the command's done. So every command gets an "arena": a few chunks from the heap, handed out by just
+   moving a pointer along (no headers, no lists), and all thrown away at once when the command returns. No frees to
+   forget, and no freeing one thing at a time. The chunks are kept for the next command, so throwing it all away is
+   just moving the pointer back to the start. */
+#define ARENACHUNK 4096
+#define ARENABIG (ARENACHUNK / 4) // bigger than this gets a chunk of its own (so it doesn't waste the rest of one)
+
+typedef struct arenachunk {
+    struct arenachunk* next;
+} arenachunk_t;
+
+typedef struct arena {
+    arenachunk_t* first; // all the chunks we've got
+    arenachunk_t* cur; // the one we're handing out of
+    uint8_t* ptr; // the next free byte in it
+    uint8_t* end;
+    arenachunk_t* big; // the big ones, which go back to the heap on reset
+} arena_t;
+
+static inline uint8_t* arenaalign(uint8_t* p) { // (everything is 16 byte aligned, like malloc)
+    return (uint8_t*)(((size_t)p + 15) & ~(size_t)15);
+}
+
+void* arena_alloc(arena_t* a, size_t size) {
+    uint8_t* p = arenaalign(a->ptr);
+    if (a->ptr && p + size <= a->end) { // the usual case
+        a->ptr = p + size;
+        return p;
+    }
+
+    if (size > ARENABIG) {
+        arenachunk_t* c = malloc(sizeof(arenachunk_t) + 15 + size);
+        if (!c) {
+            return NULL;
+        }
+        c->next = a->big;
+        a->big = c;
+        return arenaalign((uint8_t*)(c + 1));
+    }
+
+    /* This chunk's full: on to the next one we kept from last time, or a new one */
+    arenachunk_t* c = a->cur ? a->cur->next : a->first;
+    if (!c) {
+        c = malloc(ARENACHUNK);
+        if (!c) {
+            return NULL;
+        }
+        c->next = NULL;
+        if (a->cur) {
+            a->cur->next = c;
+        } else {
+            a->first = c;
+        }
+    }
+    a->cur = c;
+    a->end = (uint8_t*)c + ARENACHUNK;
+    p = arenaalign((uint8_t*)(c + 1));
+    a->ptr = p + size;
+    return p;
+}
+
+void arena_reset(arena_t* a) { // throws away everything that came from a (but keeps the chunks)
+    while (a->big) {
+        arenachunk_t* next = a->big->next;
+        free(a->big);
+        a->big = next;
+    }
+    a->cur = a->first;
+    a->ptr = a->first ? (uint8_t*)(a->first + 1) : NULL;
+    a->end = a->first ? (uint8_t*)a->first + ARENACHUNK : NULL;
+}
+
+void arena_release(arena_t* a) { // ...and this gives the chunks back to the heap too
+    arena_reset(a);
+    while (a->first) {
+        arenachunk_t* next = a->first->next;
+        free(a->first);
+        a->first = next;
+    }
+    a->cur = NULL;
+    a->ptr = a->end = NULL;
+}
+
+
+#ifndef KRNL_HOSTED
+
+/* Threads! Right now the kernel does one thing at a time: read a line, run the command, repeat. While a command runs,
+   nothing else happens. Threads fix that: each thread has its own stack and its own saved registers, and switching
+   between them is just saving one thread's registers and loading another's. These threads are "cooperative": a thread
+   keeps the CPU until it calls yield(), sleep(), wait() or waits for a key. No locks needed, because nothing can
+   switch threads behind your back.
+
+   There's always an idle thread (it's krnlMain, down at the bottom). It runs when nobody else wants to: it runs the
+   timers, wakes up whoever is waiting for a key, and otherwise hlt's. */
+#define MAXTHREADS 16
+#define STACKORDER 1 // each thread's stack is 2^STACKORDER pages...
+#define THREADSTACK (PAGESIZE << STACKORDER) // ...so this many bytes
+#define SWITCHBENCH 10000 // how many times the shell yields to measure the cost of a switch
+
+enum { T_FREE, T_READY, T_RUNNING, T_BLOCKED, T_DEAD };
+
+typedef struct thread {
+    uint32_t esp; // saved stack pointer (everything else is saved on the stack itself)
+    uint8_t* stack; // from alloc_pages (the idle thread uses the boot stack, so it's NULL there)
+    uint32_t tid;
+    int state;
+    char name[16];
+    void (*fn)(void* arg);
+    void* arg;
+    console_t* con; // where this thread's output goes
+    struct thread* next; // next in the run queue
+    struct thread* waiter; // the thread wait()ing for this one to finish
+    ktimer_t timer; // for sleep()
+    arena_t scratch; // the scratch memory for the command it's running (see cmdHandler)
+} thread_t;
+
+static thread_t threads[MAXTHREADS] = { { .state = T_RUNNING, .name = "idle" } }; // threads[0] is the idle thread
+static thread_t* cur = &threads[0]; // the thread that's running right now
+static thread_t* rqhead = NULL; // the run queue: threads that are ready to go, first come first served
+static thread_t* rqtail = NULL;
+static thread_t* lastdead = NULL; // a thread that just exited, its stack gets freed once we're off it
+static thread_t* kbdwaiter = NULL; // the thread waiting for a key
+static uint32_t nexttid = 1;
+static uint32_t switchcycles = 0; // what one thread switch costs, measured at boot
+
+/* The actual switch. switch_to(&old->esp, new->esp) pushes the registers C expects to survive a function call,
+   saves the stack pointer, loads the other thread's stack pointer, pops ITS registers and returns - into the other
+   thread, right where it called switch_to. That's the whole trick: 10 instructions. */
+void switch_to(uint32_t* oldesp, uint32_t newesp);
+__asm__ (
+    ".pushsection .text\n"
+    ".globl switch_to\n"
+    "switch_to:\n"
+    "    mov 4(%esp), %eax\n"
+    "    mov 8(%esp), %edx\n"
+    "    push %ebp\n"
+    "    push %ebx\n"
+    "    push %esi\n"
+    "    push %edi\n"
+    "    mov %esp, (%eax)\n"
+    "    mov %edx, %esp\n"
+    "    pop %edi\n"
+    "    pop %esi\n"
+    "    pop %ebx\n"
+    "    pop %ebp\n"
+    "    ret\n"
+    ".popsection\n"
+);
+
+static void rqpush(thread_t* t) {
+    t->state = T_READY;
+    t->next = NULL;
+    if (rqtail) {
+        rqtail->next = t;
+    } else {
+        rqhead = t;
+    }
+    rqtail = t;
+}
+
+static void switchdone() { // runs on the new thread right after every switch
+    if (lastdead && lastdead != cur) { // now that we're off its stack, the dead thread's stack can go
+        free_pages(lastdead->stack, STACKORDER);
+        lastdead->stack = NULL;
+        lastdead->state = T_FREE;
+        lastdead = NULL;
+    }
+}
+
+static void schedule() { // switch to the next ready thread (the caller already put cur wherever it belongs)
+    thread_t* next = rqhead;
+    if (next) {
+        rqhead = next->next;
+        if (!rqhead) {
+            rqtail = NULL;
+        }
+    } else {
+        next = &threads[0]; // nobody's ready, so idle
+    }
+    if (next == cur) {
+        cur->state = T_RUNNING;
+        return;
+    }
+
+    thread_t* prev = cur;
+    prev->con = con; // the console output is going to belongs to the thread too
+    cur = next;
+    con = next->con;
+    next->state = T_RUNNING;
+    switch_to(&prev->esp, next->esp);
+    switchdone();
+}
+
+void yield() { // let everyone else who's ready have a go
+    if (cur == &threads[0]) { // the idle thread doesn't queue up, it only runs when nobody else is ready
+        if (rqhead) {
+            schedule();
+        }
+        return;
+    }
+    rqpush(cur);
+    schedule();
+}
+
+static void block() { // stop running until someone calls wake() on us
+    cur->state = T_BLOCKED;
+    schedule();
+}
+
+static void wake(thread_t* t) {
+    if (t->state == T_BLOCKED) {
+        rqpush(t);
+    }
+}
+
+static void exitthread() {
+    arena_release(&cur->scratch);
+    if (cur->waiter) {
+        wake(cur->waiter);
+    }
+    cur->state = T_DEAD;
+    lastdead = cur;
+    schedule(); // never comes back
+}
+
+static void threadentry() { // where a new thread starts (switch_to "returns" here the first time)
+    switchdone();
+    cur->fn(cur->arg);
+    exitthread();
+}
+
+/* Makes a new thread that runs fn(arg), and gives back its id (0 if we're out of threads or memory).
+   Its stack is set up to look exactly like switch_to left it, with threadentry as the return address. */
+uint32_t spawn(const char* name, void (*fn)(void* arg), void* arg) {
+    thread_t* t = NULL;
+    for (size_t i = 1; i < MAXTHREADS && !t; i++) {
+        if (threads[i].state == T_FREE) {
+            t = &threads[i];
+        }
+    }
+    if (!t) {
+        return 0;
+    }
+    /* Not malloc: with paging on, heap pages only appear when they're first touched (see pagefault), and a stack can't
+       take a page fault - the CPU would need that same stack to report it. alloc_pages memory is always there. */
+    t->stack = alloc_pages(STACKORDER);
+    if (!t->stack) {
+        return 0;
+    }
+
+    uint32_t* sp = (uint32_t*)(((uint32_t)t->stack + THREADSTACK) & ~15u); // line the stack up to 16 bytes
+    *--sp = 0; // threadentry's "return address" (it never returns)
+    *--sp = (uint32_t)threadentry; // where switch_to's ret goes
+    *--sp = 0; // ebp
+    *--sp = 0; // ebx
+    *--sp = 0; // esi
+    *--sp = 0; // edi
+    t->esp = (uint32_t)sp;
+
+    size_t n = 0;
+    while (name[n] && n < sizeof(t->name) - 1) {
+        t->name[n] = name[n];
+        n++;
+    }
+    t->name[n] = '\0';
+    t->tid = nexttid++;
+    t->fn = fn;
+    t->arg = arg;
+    t->con = con; // new threads print wherever their parent was printing
+    t->waiter = NULL;
+    rqpush(t);
+    return t->tid;
+}
+
+static void sleepwake(void* arg) {
+    wake((thread_t*)arg);
+}
+
+void sleep(uint32_t ms) {
+    timer_add(&cur->timer, ms, sleepwake, cur);
+    block();
+}
+
+void wait(uint32_t tid) { // waits until thread tid is finished
+    for (size_t i = 1; i < MAXTHREADS; i++) {
+        thread_t* t = &threads[i];
+        if (t->tid == tid && t->state != T_FREE) {
+            t->waiter = cur;
+            while (t->tid == tid && t->state != T_FREE && t->state != T_DEAD) {
+                block();
+            }
+            return;
+        }
+    }
+}
+
+static void kbdwait() {
+    kbdwaiter = cur;
+    block();
+}
+
+static void switchbench(void* arg) { // the other half of the ping-pong in threadsinit
+    (void)arg;
+    for (size_t i = 0; i < SWITCHBENCH; i++) {
+        yield();
+    }
+}
+
+void pscmd() {
+    static const char* const states[] = { "free", "ready", "running", "blocked", "dead" };
+    kprintf("A thread switch takes %u cycles", switchcycles);
+    for (size_t i = 0; i < MAXTHREADS; i++) {
+        if (threads[i].state != T_FREE) {
+            kprintf("\n  %u  %s  %s", threads[i].tid, states[threads[i].state], threads[i].name);
+        }
+    }
+}
+
+/* The shell is a thread too. A command ending in & runs in a thread of its own, so the shell can carry on */
+void* scratch(size_t size) { // memory that's gone once the current command is done
+    return arena_alloc(&cur->scratch, size);
+}
+
+void scratchreset() {
+    arena_reset(&cur->scratch);
+}
+
+static void jobmain(void* arg) {
+    cmdHandler((const char*)arg);
+    kprintf("\n[%u] done\n", cur->tid);
+    free(arg);
+}
+
+static void shell(void* arg) {
+    (void)arg;
+
+    /* First, time a thread switch: ping-pong with another thread SWITCHBENCH times each */
+    uint32_t tid = spawn("switchbench", switchbench, NULL);
+    uint64_t t0 = rdtsc();
+    for (size_t i = 0; i < SWITCHBENCH; i++) {
+        yield();
+    }
+    uint64_t t1 = rdtsc();
+    wait(tid);
+    switchcycles = (uint32_t)div64(t1 - t0, SWITCHBENCH * 2, NULL);
+
+    char ibuffer[MAXBUFSZ];
+    while (1) {
+        readstr(ibuffer, sizeof(ibuffer)); // this comes back with con set to the console enter was pressed on
+        size_t len = strlen(ibuffer);
+        if (len && ibuffer[len - 1] == '&') {
+            do {
+                ibuffer[--len] = '\0'; // take the & (and any spaces before it) off
+            } while (len && ibuffer[len - 1] == ' ');
+            char* job = malloc(len + 1);
+            uint32_t jobtid = 0;
+            if (job) {
+                for (size_t i = 0; i <= len; i++) {
+                    job[i] = ibuffer[i];
+                }
+                jobtid = spawn(job, jobmain, job);
+                if (!jobtid) {
+                    free(job);
+                }
+            }
+            if (jobtid) {
+                kprintf("[%u] started", jobtid);
+            } else {
+                puts("Can't start another thread!");
+            }
+        } else {
+            cmdHandler(ibuffer);
+        }
+        puts("\n");
+        puts("PROMPT >>> ");
+    }
+}
+
+
+/* SMP (more than one CPU)! Every PC these days has several CPUs (or cores, same thing for us), but only one of them
+   runs when the machine starts - the "bootstrap processor". The rest (the "application processors") sit there until
+   someone wakes them up, by sending them an INIT and then a STARTUP message through the local APIC (the bit of each CPU
+   that sends and receives interrupts). STARTUP makes them start running in 16 bit real mode (like an old 8086!) at an
+   address below 1MB that we pick, so we put a little bit of code there that switches to 32 bit mode and jumps to ap_main.
+
+   Try it with "qemu -smp 4", then run "smpbench". */
+#define TRAMPOLINE 0x8000 // where the APs start (it has to be page aligned and below 1MB)
+#define APSTACK 8192 // how much stack each AP gets
+#define SMPBENCHOPS 200000 // malloc+free pairs each CPU does in smpbench
+#define SMPBENCHLIVE 64 // blocks each CPU keeps allocated at a time in smpbench
+#define SMPBENCHMAX 256 // and the biggest size it asks for
+
+#define STR2(x) #x
+#define STR(x) STR2(x)
+
+// (only the asm below touches these two, hence "used")
+static uint8_t apstacks[MAXCPUS][APSTACK] __attribute__((aligned(16), used));
+static volatile uint32_t apnext __attribute__((used)) = 1; // the id the next AP to wake up takes
+static volatile uint32_t ncpus = 1;
+
+void ap_main(uint32_t id);
+__asm__ (
+    ".pushsection .text\n"
+    ".code16\n"
+    "ap_trampoline:\n" // (copied to TRAMPOLINE, so only ever use addresses worked out from there)
+    "    cli\n"
+    "    xor %ax, %ax\n"
+    "    mov %ax, %ds\n"
+    "    lgdtl " STR(TRAMPOLINE) " + (ap_trampoline_gdtr - ap_trampoline)\n"
+    "    mov %cr0, %eax\n"
+    "    or $1, %eax\n" // protected mode on
+    "    mov %eax, %cr0\n"
+    "    ljmpl $0x08, $ap_start32\n" // and straight into the kernel, where it really is
+    ".align 4\n"
+    "ap_trampoline_gdtr:\n" // (smpinit fills this in with our GDT)
+    "    .word 0\n"
+    "    .long 0\n"
+    "ap_trampoline_end:\n"
+    ".code32\n"
+    "ap_start32:\n"
+    "    mov $0x10, %ax\n"
+    "    mov %ax, %ds\n"
+    "    mov %ax, %es\n"
+    "    mov %ax, %fs\n"
+    "    mov %ax, %ss\n"
+    "    mov $1, %eax\n"
+    "    lock xadd %eax, apnext\n" // take an id (and so a stack). They all start at once, so this has to be atomic
+    "    cmp $" STR(MAXCPUS) ", %eax\n"
+    "    jae 2f\n" // more CPUs than we have room for, this one just stops
+    "    lea 1(%eax), %ecx\n"
+    "    imul $" STR(APSTACK) ", %ecx\n"
+    "    add $apstacks, %ecx\n" // stack top = apstacks[id + 1]
+    "    mov %ecx, %esp\n"
+    "    push %eax\n"
+    "    call ap_main\n"
+    "2:  cli\n"
+    "    hlt\n"
+    "    jmp 2b\n"
+    ".popsection\n"
+);
+extern char ap_trampoline[], ap_trampoline_gdtr[], ap_trampoline_end[];
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void udelay(uint32_t us) { // busy-waits for us microseconds, using the TSC
+    uint64_t end = rdtsc() + div64((uint64_t)tsckhz * us, 1000, NULL); // (not "/", see div64)
+    while (rdtsc() < end) {
+        __asm__ __volatile__ ("pause");
+    }
+}
+
+static void lapicenable() {
+    lapic[0xF0 / 4] = 0x100 | SPURIOUSVEC; // the "spurious interrupt vector" register, bit 8 turns the APIC on
+    lapic[0x80 / 4] = 0; // accept every interrupt priority
+}
+
+static void lapicipi(uint32_t apicid, uint32_t cmd) { // sends an inter-processor interrupt
+    lapic[0x310 / 4] = apicid << 24;
+    lapic[0x300 / 4] = cmd;
+    while (lapic[0x300 / 4] & (1u << 12)) { // wait until it's been sent
+        __asm__ __volatile__ ("pause");
+    }
+}
+
+static void runon(uint32_t cpu, void (*fn)(void)) { // asks another CPU to run fn
+    percpu[cpu].work = fn;
+    lapicipi(percpu[cpu].apicid, IPIVEC);
+}
+
+/* Gives every CPU a segment that starts at its own percpu_t, so "gs:0" is always "my percpu_t" no matter which CPU
+   asks. The bootstrap CPU loads its gs right here, the APs in ap_main */
+void percpuinit() {
+    for (uint32_t i = 0; i < MAXCPUS; i++) {
+        uint32_t base = (uint32_t)&percpu[i];
+        gdt[3 + i] = 0x00CF92000000FFFFull | ((uint64_t)(base & 0xFFFFFF) << 16) | ((uint64_t)(base >> 24) << 56);
+        percpu[i].self = &percpu[i];
+        percpu[i].id = i;
+    }
+    percpu[0].online = 1;
+    __asm__ __volatile__ ("mov %0, %%gs" : : "r"((uint16_t)(3 * 8)));
+    percpuready = 1;
+}
+
+void ap_main(uint32_t id) {
+    percpu_t* c = &percpu[id];
+    sseinit();
+    if (pagingon) {
+        pagingenable();
+    }
+    __asm__ __volatile__ ("mov %0, %%gs" : : "r"((uint16_t)((3 + id) * 8)));
+    __asm__ __volatile__ ("lidt %0" : : "m"(idtr));
+    __asm__ __volatile__ ("ltr %0" : : "r"((uint16_t)((GDT_TSS + id) * 8)));
+    lapicenable();
+    c->apicid = lapic[0x20 / 4] >> 24;
+    c->online = 1;
+    __sync_fetch_and_add(&ncpus, 1);
+
+    while (1) { // wait for something to do (runon sends an IPI, which wakes us from hlt)
+        __asm__ __volatile__ ("cli");
+        if (!c->work) {
+            __asm__ __volatile__ ("sti; hlt" ::: "memory");
+            continue;
+        }
+        __asm__ __volatile__ ("sti");
+        c->work();
+        remoteflush(c, 1); // don't sit on other CPUs' pieces until the next job
+        c->work = NULL;
+    }
+}
+
+void smpinit() {
+    if (!(rdmsr(0x1B) & (1u << 11))) { // the local APIC is turned off (or missing), so no SMP for us
+        return;
+    }
+    lapic = (volatile uint32_t*)(uint32_t)(rdmsr(0x1B) & 0xFFFFF000);
+    lapicenable();
+    percpu[0].apicid = lapic[0x20 / 4] >> 24;
+
+    uint8_t* dst = (uint8_t*)TRAMPOLINE;
+    for (char* src = ap_trampoline; src < ap_trampoline_end; src++) {
+        *dst++ = (uint8_t)*src;
+    }
+    dtptr_t* gdtr = (dtptr_t*)(TRAMPOLINE + (ap_trampoline_gdtr - ap_trampoline));
+    gdtr->limit = sizeof(gdt) - 1;
+    gdtr->base = (uint32_t)gdt;
+
+    /* INIT, wait 10ms, then STARTUP twice (that's what the Intel manual says). 0xC0000 = "everyone but me",
+       and the STARTUP's low byte is the page the APs start at */
+    lapicipi(0, 0x000C4500);
+    udelay(10000);
+    lapicipi(0, 0x000C4600 | (TRAMPOLINE >> 12));
+    udelay(200);
+    lapicipi(0, 0x000C4600 | (TRAMPOLINE >> 12));
+    udelay(100000); // give them time to check in
+}
+
+/* The benchmark: every CPU hammers malloc/free with small random sizes. With the per-CPU stashes they (almost) never
+   touch shared memory, so N CPUs should get about N times the work done */
+static volatile int smpbenchgo = 0;
+static volatile uint32_t smpbenchdone = 0;
+static uint64_t smpbenchcycles[MAXCPUS];
+
+static void smpbenchwork() {
+    percpu_t* c = thiscpu();
+    void* live[SMPBENCHLIVE];
+    uint32_t seed = c->id * 7919 + 1;
+    for (size_t i = 0; i < SMPBENCHLIVE; i++) {
+        live[i] = NULL;
+    }
+    while (!smpbenchgo) {
+        __asm__ __volatile__ ("pause");
+    }
+
+    uint64_t t0 = rdtsc();
+    for (uint32_t i = 0; i < SMPBENCHOPS; i++) {
+        size_t slot = i % SMPBENCHLIVE;
+        free(live[slot]);
+        seed = seed * 1103515245 + 12345;
+        live[slot] = malloc(16 + (seed >> 16) % (SMPBENCHMAX - 16));
+    }
+    for (size_t i = 0; i < SMPBENCHLIVE; i++) {
+        free(live[i]);
+    }
+    smpbenchcycles[c->id] = rdtsc() - t0;
+    remoteflush(c, 1); // (after the clock stops, and before we say we're done, so nothing is left pinned after the run)
+    __sync_fetch_and_add(&smpbenchdone, 1);
+}
+
+void smpbench() {
+    kprintf("CPUs online: %u", ncpus);
+    int wastracing = traceon;
+    traceon = 0; // the tracer's ring is shared by everyone, so it'd be the thing we're measuring
+    for (uint32_t n = 1; n <= ncpus; n++) {
+        smpbenchgo = 0;
+        smpbenchdone = 0;
+        for (uint32_t i = 1; i < n; i++) {
+            runon(i, smpbenchwork);
+        }
+        smpbenchgo = 1;
+        smpbenchwork(); // we're one of the CPUs too
+        while (smpbenchdone < n) {
+            __asm__ __volatile__ ("pause");
+        }
+
+        uint64_t worst = 0; // the run took as long as the slowest CPU
+        for (uint32_t i = 0; i < n; i++) {
+            if (smpbenchcycles[i] > worst) {
+                worst = smpbenchcycles[i];
+            }
+        }
+        uint64_t ops = (uint64_t)n * SMPBENCHOPS * 2;
+        kprintf("\n  %u CPU(s): %u malloc/free per ms", n, (uint32_t)div64(ops * tsckhz, (uint32_t)(worst >> 8) + 1, NULL) >> 8);
+    }
+    traceon = wastracing;
+}
+
+
+/* Extra: a profiler! When something is slow, the question is always "where is the time going?". A neat trick to find out:
+   every timer tick (1000 times a second), look at where the CPU was when the interrupt hit (the eip the CPU saved) and
+   count it. Code that runs a lot gets interrupted a lot, so after a few seconds the counts show where the time went.
+
+   The counting happens inside an interrupt, so it can't malloc or print - it just bumps a counter in a fixed table
+   (a little hash table keyed by address). All the slow stuff (matching addresses to function names, sorting, printing)
+   waits for "prof dump". */
+#define PROFSLOTS 4096 // how many different addresses we can count (a power of 2)
+#define PROFPROBES 8 // how many slots we look at before giving up on a sample
+#define PROFTOP 10 // how many functions "prof dump" shows
+
+static uint32_t profaddr[PROFSLOTS]; // the address counted in each slot (0 = empty)
+static uint32_t profcount[PROFSLOTS];
+static uint32_t profsamples = 0; // every sample taken
+static uint32_t profdropped = 0; // samples that didn't fit in the table
+
+static void profsample(uint32_t eip) {
+    profsamples++;
+    uint32_t h = (eip * 2654435761u) >> 20; // mixes the address bits up so neighbouring addresses land far apart
+    for (uint32_t i = 0; i < PROFPROBES; i++) {
+        uint32_t slot = (h + i) & (PROFSLOTS - 1);
+        if (profaddr[slot] == eip) {
+            profcount[slot]++;
+            return;
+        }
+        if (!profaddr[slot]) {
+            profaddr[slot] = eip;
+            profcount[slot] = 1;
+            return;
+        }
+    }
+    profdropped++;
+}
+
+/* The symbol table: where every function starts and ends, so the profile can put names on addresses. Only the linker
+   knows that, so the table is made from the linked kernel with nm and compiled back in. That means linking twice:
+       gcc ... -c kernel.c && ld ... -o kernel.elf kernel.o             (the first time there's no table)
+       nm -nS --defined-only kernel.elf | awk '$(NF-1) ~ /^[tT]$/ {
+           if (name) print "{ 0x" start ", 0x" $1 ", \"" name "\" },";   # (no size: it ends where the next one starts)
+           name = "";
+           if (NF == 4) print "{ 0x" $1 ", 0x" $1 " + 0x" $2 ", \"" $4 "\" },"; else { start = $1; name = $3 }
+       }' > ksyms.inc
+       gcc ... -DKSYMS='"ksyms.inc"' -c kernel.c && ld ... -o kernel.elf kernel.o
+   The table and its strings only go in .rodata, after all the code, and the code only ever sees it through ksyms and
+   nksyms (which it has to load, it can't know them), so the code is the same size both times, no function moves, and
+   the table describes the kernel it's in. It has everything nm sees: static functions, isr_common and the other asm
+   labels, and gcc's ".cold" pieces too, already sorted by address. Without a table every sample counts as "?". */
+typedef struct ksym {
+    uint32_t start, end; // the function is start..end-1
+    const char* name;
+} ksym_t;
+
+static const ksym_t ksymtable[] = {
+#ifdef KSYMS
+#include KSYMS
+#endif
+    { 0, 0, "" } // (so the table is never empty - this one never matches anything)
+};
+const ksym_t* ksyms = ksymtable;
+uint32_t nksyms = sizeof(ksymtable) / sizeof(ksymtable[0]) - 1;
+
+static int ksymfind(uint32_t addr) { // which function is addr in? (-1 if it isn't in any we know of)
+    int lo = 0, hi = (int)nksyms - 1, found = -1; // binary search for the last symbol that starts <= addr
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (ksyms[mid].start <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found >= 0 && addr < ksyms[found].end ? found : -1; // (between two functions, or past the last one)
+}
+
+void profcmd(uint32_t argc, char** argv) {
+    const char* args = argc == 2 ? argv[1] : "";
+
+    if (strcmp(args, "start") == 0) {
+        profon = 0;
+        for (size_t i = 0; i < PROFSLOTS; i++) {
+            profaddr[i] = 0;
+        }
+        profsamples = profdropped = 0;
+        profon = 1;
+        puts("Profiling...");
+    }
+
+    else if (strcmp(args, "stop") == 0) {
+        profon = 0;
+        puts("Stopped.");
+    }
+
+    else if (strcmp(args, "dump") == 0) {
+        uint32_t* perfunc = scratch((nksyms + 1) * sizeof(uint32_t)); // samples per function (the last one is "?")
+        if (!perfunc) {
+            puts("Out of memory");
+            return;
+        }
+        int wason = profon;
+        profon = 0; // hold still while we read the table
+        memset(perfunc, 0, (nksyms + 1) * sizeof(uint32_t));
+        for (size_t i = 0; i < PROFSLOTS; i++) {
+            if (profaddr[i]) {
+                int k = ksymfind(profaddr[i]);
+                perfunc[k < 0 ? nksyms : (uint32_t)k] += profcount[i];
+            }
+        }
+        uint32_t total = profsamples;
+        profon = wason;
+
+        kprintf("%u samples", total);
+        if (profdropped) {
+            kprintf(" (%u didn't fit)", profdropped);
+        }
+        for (size_t n = 0; n < PROFTOP && total; n++) { // pick the biggest one, print it, clear it, repeat
+            size_t best = 0;
+            for (size_t i = 1; i <= nksyms; i++) {
+                if (perfunc[i] > perfunc[best]) {
+                    best = i;
+                }
+            }
+            if (!perfunc[best]) {
+                break;
+            }
+            kprintf("\n  %3u%%  %6u  %s", perfunc[best] * 100 / total, perfunc[best],
+                    best < nksyms ? ksyms[best].name : "?");
+            perfunc[best] = 0;
+        }
+    }
+
+    else {
+        puts("Usage: prof start|stop|dump");
+    }
+}
+
+
+/* Extra number two: an event tracer. The profiler tells you where time goes on average; the tracer tells you exactly
+   what happened and when. Interesting places (boot steps, malloc/free, keys, commands) call trace(), which writes a tiny
+   record (TSC timestamp, what happened, two numbers) into a ring buffer. No printing, no formatting - printing text
+   right when it happens would take longer than most of the things we're timing! "trace dump" turns the records into
+   text later. */
+#define TRACESIZE 4096 // records in the ring (a power of 2). The oldest ones get written over
+#define TRACEDUMP 40 // how many records "trace dump" shows if you don't say
+
+typedef struct tracerec {
+    uint64_t tsc;
+    uint32_t id; // one of the TR_ things at the top
+    uint32_t a, b;
+    uint32_t cpu; // which CPU it happened on
+} tracerec_t;
+
+static tracerec_t tracebuf[TRACESIZE];
+static uint32_t tracehead = 0; // total records ever written (so tracehead % TRACESIZE is the next spot)
+
+static void trace(uint32_t id, uint32_t a, uint32_t b) {
+    if (!traceon) {
+        return;
+    }
+    /* Grab a spot with one atomic add. Even if an interrupt comes in the middle and traces something too, it gets
+       its own spot, so nobody has to lock anything */
+    tracerec_t* r = &tracebuf[__sync_fetch_and_add(&tracehead, 1) & (TRACESIZE - 1)];
+    r->tsc = rdtsc();
+    r->id = id;
+    r->a = a;
+    r->b = b;
+    r->cpu = thiscpu()->id;
+}
+
+static const char* const tracenames[TR_NEVENTS] = { "boot", "key", "cmd", "cmd done", "malloc", "free" };
+static const char* const bootnames[BOOT_NSTEPS] = { "start", "interrupts", "timer", "memory", "smp", "consoles" };
+
+void tracecmd(uint32_t argc, char** argv) {
+    const char* args = argc >= 2 ? argv[1] : "";
+
+    if (strcmp(args, "dump") == 0 && argc <= 3) {
+        uint32_t count = (argc == 3) ? (uint32_t)atoi(argv[2]) : TRACEDUMP;
+        int wastracing = traceon;
+        traceon = 0; // hold still while we read
+        uint32_t head = tracehead;
+        uint32_t avail = (head < TRACESIZE) ? head : TRACESIZE;
+        if (count == 0 || count > avail) {
+            count = avail;
+        }
+
+        uint64_t first = tracebuf[(head - count) & (TRACESIZE - 1)].tsc;
+        for (uint32_t i = head - count; i != head; i++) {
+            tracerec_t* r = &tracebuf[i & (TRACESIZE - 1)];
+            uint32_t us = (uint32_t)div64(mulshr(r->tsc - first, tscmult, tscshift), 1000, NULL);
+            kprintf("\n+%uus %s ", us, r->id < TR_NEVENTS ? tracenames[r->id] : "?");
+            if (r->id == TR_BOOT) {
+                puts(r->a < BOOT_NSTEPS ? bootnames[r->a] : "?");
+            } else if (r->id == TR_CMD || r->id == TR_CMDDONE) {
+                char name[5];
+                size_t len = 0;
+                while (len < 4 && (r->a >> (len * 8)) & 0xFF) {
+                    name[len] = (char)(r->a >> (len * 8));
+                    len++;
+                }
+                name[len] = '\0';
+                puts(name);
+            } else if (r->id == TR_MALLOC) {
+                kprintf("%u -> 0x%08X", r->a, r->b);
+            } else if (r->id == TR_FREE) {
+                kprintf("0x%08X", r->a);
+            } else {
+                kprintf("0x%08X 0x%08X", r->a, r->b);
+            }
+        }
+        traceon = wastracing;
+    }
+
+    else if (strcmp(args, "clear") == 0) {
+        tracehead = 0;
+    }
+
+    else {
+        puts("Usage: trace dump [count] | trace clear");
+    }
+}
+
+
+/* I'm not actually going to use the memory allocation here, but you can do what you feel like. */
+
+void krnlMain(uint32_t magic, uint32_t* info) { // (see multiboot() for where these come from)
+    sseinit(); // (first, memcpy and memset are everywhere)
+    trace(TR_BOOT, BOOT_START, 0);
+    intinit();
+    serialinit(); // (as early as can be, so there's somewhere to see what goes wrong)
+    percpuinit();
+    trace(TR_BOOT, BOOT_INT, 0);
+    timerinit();
+    trace(TR_BOOT, BOOT_TIMER, 0);
+    init_memory_manager(magic, info);
+    trace(TR_BOOT, BOOT_MEM, pagestotal);
+    smpinit();
+    trace(TR_BOOT, BOOT_SMP, ncpus);
+    for (size_t i = 0; i < NCONSOLES; i++) { // set up the virtual consoles, each one in its own slice of VGA memory
+        consoles[i].color = VGCOL;
+        consoles[i].vgabase = i * CONROWS;
+        con = &consoles[i];
+        clrscr();
+        puts("PROMPT >>> ");
+    }
+    trace(TR_BOOT, BOOT_CONSOLES, 0);
+
+    /* From here on, krnlMain is the idle thread */
+    con = fgcon;
+    spawn("shell", shell, NULL);
+    while (1) {
+        timers_run();
+        if (kbdwaiter && inputready()) { // a key came in and someone's waiting for one
+            thread_t* t = kbdwaiter;
+            kbdwaiter = NULL;
+            wake(t);
+        }
+        if (rqhead) {
+            yield();
+            continue;
+        }
+
+        __asm__ __volatile__ ("cli");
+        if ((int32_t)(jiffies - wheelnow) < 0 && (!kbdwaiter || !inputready())) { // (checked with interrupts off,
+            __asm__ __volatile__ ("sti; hlt" ::: "memory"); // so nothing can sneak in between the check and the hlt)
+        } else {
+            __asm__ __volatile__ ("sti");
+        }
+    }
+}
+
+#else // KRNL_HOSTED
+
+/* The hosted build's main(): benchmarks for the allocator and the console, so a change to either one can be measured
+   instead of guessed at. Everything is the same every run (same random seed, same number of operations), so two
+   builds can be compared number for number.
+
+       ./kbench                  all of it
+       ./kbench alloc            the made up ("synthetic") allocation traces
+       ./kbench replay <file>    an allocation trace recorded on the real kernel: save what "trace dump" prints
+       ./kbench console          console output
+       ./kbench test             not a benchmark: checks the allocator and kprintf do the right thing (see tzero and on)
+
+   Every benchmark runs in its own forked copy of the program, so each one starts with a fresh memory manager.
+   Times come from the TSC around every operation, so they include a few ns for the rdtsc itself. */
+#define BENCHRAM (64u << 20) // how much "RAM" the memory manager gets
+#define BENCHOPS (1u << 20) // the most operations we keep times for
+#define ALLOCOPS 400000
+#define ALLOCSLOTS 4096 // the most allocations one trace keeps alive at once
+#define REPLAYHASH (1u << 16) // (a power of 2, bigger than anything the trace ring holds)
+
+static void trace(uint32_t id, uint32_t a, uint32_t b) { // (nowhere to keep a trace in the hosted build)
+    (void)id;
+    (void)a;
+    (void)b;
+    (void)traceon;
+}
+
+static uint32_t lat[BENCHOPS]; // how many TSC ticks each operation took
+static uint32_t nlat, nops;
+static uint64_t opstarted;
+static size_t benchbytes; // console benchmarks: how much text went out
+static size_t live, peaklive; // allocation benchmarks: bytes asked for and not freed yet
+static size_t endpages, endfrag; // ...and how things looked at the end, before cleaning up
+static uint32_t seed;
+
+static inline void opstart() {
+    opstarted = rdtsc();
+}
+
+static inline void opend() {
+    uint64_t t = rdtsc() - opstarted;
+    nops++;
+    if (nlat < BENCHOPS) {
+        lat[nlat++] = (uint32_t)t;
+    }
+}
+
+static uint32_t rnd() { // xorshift: random enough, and the same sequence every time
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static int latcmp(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* The memory manager, set up like the real one: a multiboot memory map (one piece of RAM, which we mmap). Multiboot 2,
+   because it has the map right in the info structure with 64 bit addresses, and mmap can put the RAM anywhere. (Linux
+   puts it above the program, so multiboot()'s "everything up to the end of the kernel is taken" leaves it alone.) */
+static uint32_t benchinfo[14] = {
+    14 * 4, 0, // total size, reserved
+    6, 16 + 24, 24, 0, // the memory map tag: type, size, size of an entry, entry version
+    0, 0, BENCHRAM, 0, 1, 0, // the one entry: base (benchmem fills it in), length, type 1 = usable, reserved
+    0, 8 // the end tag
+};
+
+static void benchmem() {
+    void* ram = mmap(NULL, BENCHRAM, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ram == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    benchinfo[6] = (uint32_t)(size_t)ram;
+    benchinfo[7] = (uint32_t)((uint64_t)(size_t)ram >> 32);
+    init_memory_manager(MB2MAGIC, benchinfo);
+}
+
+static void benchalloced(void* p, size_t size) {
+    if (p) {
+        live += size;
+        if (live > peaklive) {
+            peaklive = live;
+        }
+    }
+}
+
+static void benchsnapshot() { // how full and how fragmented things are, while everything's still allocated
+    size_t largest = heaplargest(NULL);
+    endpages = pagestotal - pagesfree;
+    endfrag = heap.freebytes ? 100 - largest * 100 / heap.freebytes : 0;
+}
+
+/* The synthetic traces. Each one does ALLOCOPS mallocs, frees and reallocs (well, about) */
+static void *slots[ALLOCSLOTS];
+static size_t slotsize[ALLOCSLOTS];
+
+static void slotfree(uint32_t i) {
+    opstart();
+    free(slots[i]);
+    opend();
+    live -= slotsize[i];
+    slots[i] = NULL;
+}
+
+static void slotsfree() {
+    benchsnapshot();
+    for (uint32_t i = 0; i < ALLOCSLOTS; i++) {
+        if (slots[i]) {
+            slotfree(i);
+        }
+    }
+}
+
+static void slotalloc(uint32_t i, size_t size) {
+    opstart();
+    slots[i] = malloc(size);
+    opend();
+    slotsize[i] = slots[i] ? size : 0;
+    benchalloced(slots[i], size);
+}
+
+static void wllifo() { // bursts of small allocations, freed newest first (like a command's temporary stuff)
+    for (uint32_t ops = 0; ops < ALLOCOPS; ) {
+        uint32_t n = 1 + rnd() % 64;
+        for (uint32_t i = 0; i < n; i++) {
+            slotalloc(i, 16 + rnd() % 240);
+        }
+        benchsnapshot();
+        for (uint32_t i = n; i-- > 0; ) {
+            slotfree(i);
+        }
+        ops += 2 * n;
+    }
+}
+
+static void wlrandom(uint32_t minshift, uint32_t shifts) { // random sizes from 2^minshift up, freed in random order
+    for (uint32_t ops = 0; ops < ALLOCOPS; ops++) {
+        uint32_t i = rnd() % ALLOCSLOTS;
+        if (slots[i]) {
+            slotfree(i);
+        } else {
+            size_t size = (size_t)1 << (minshift + rnd() % shifts); // the same number of each power of two...
+            slotalloc(i, size + rnd() % size); // ...and anything in between
+        }
+    }
+    slotsfree();
+}
+
+static void wlsmall() {
+    wlrandom(3, 6); // 8 bytes to 512 (slabs)
+}
+
+static void wlmixed() {
+    wlrandom(4, 12); // 16 bytes to 64KB (slabs, the heap and whole pages)
+}
+
+static void wlrealloc() { // buffers that keep doubling (a growing string or array)
+    for (uint32_t ops = 0; ops < ALLOCOPS; ops++) {
+        uint32_t i = rnd() % 256;
+        if (!slots[i]) {
+            slotalloc(i, 16);
+        } else if (slotsize[i] >= 64 * 1024) {
+            slotfree(i);
+        } else {
+            opstart();
+            void* p = realloc(slots[i], slotsize[i] * 2);
+            opend();
+            if (p) {
+                slots[i] = p;
+                benchalloced(p, slotsize[i]);
+                slotsize[i] *= 2;
+            }
+        }
+    }
+    slotsfree();
+}
+
+/* A recorded trace: the malloc and free lines from "trace dump" on the real kernel, like
+       +1234us malloc 24 -> 0x0012A010
+       +1240us free 0x0012A010
+   The addresses in the trace get matched up with what our malloc gives back. Anything freed that was allocated
+   before the trace starts (the ring only keeps the newest events) is just skipped. */
+static const char* replayfile;
+static uint32_t replayaddr[REPLAYHASH];
+static void* replayptr[REPLAYHASH];
+static size_t replaysize[REPLAYHASH];
+
+static uint32_t replayslot(uint32_t addr) {
+    uint32_t h = (addr >> 4) * 2654435761u % REPLAYHASH;
+    while (replayaddr[h] && replayaddr[h] != addr) {
+        h = (h + 1) % REPLAYHASH;
+    }
+    return h;
+}
+
+static void wlreplay() {
+    FILE* f = fopen(replayfile, "r");
+    if (!f) {
+        perror(replayfile);
+        exit(1);
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char* m = strstr(line, " malloc ");
+        char* fr = strstr(line, " free ");
+        if (m) {
+            size_t size = strtoul(m + 8, &m, 10);
+            char* arrow = strstr(m, "-> ");
+            uint32_t addr = arrow ? (uint32_t)strtoul(arrow + 3, NULL, 16) : 0;
+            if (!addr) { // (it failed on the real thing too)
+                continue;
+            }
+            uint32_t h = replayslot(addr);
+            opstart();
+            void* p = malloc(size);
+            opend();
+            replayaddr[h] = addr;
+            replayptr[h] = p;
+            replaysize[h] = p ? size : 0;
+            benchalloced(p, size);
+        } else if (fr) {
+            uint32_t h = replayslot((uint32_t)strtoul(fr + 6, NULL, 16));
+            if (!replayaddr[h]) {
+                continue;
+            }
+            opstart();
+            free(replayptr[h]);
+            opend();
+            live -= replaysize[h];
+            replayptr[h] = NULL; // (left in the table as a tombstone, so later lookups still get past it)
+            replaysize[h] = 0;
+        }
+    }
+    fclose(f);
+    benchsnapshot();
+    for (uint32_t h = 0; h < REPLAYHASH; h++) {
+        if (replayptr[h]) {
+            free(replayptr[h]);
+        }
+    }
+}
+
+/* The console ones. The "VGA memory" is just an array here, so these measure our side of the work (the scrollback
+   ring, the dirty rows, the copying in flush) but not how slow real VGA memory is. */
+static const char benchline[] = "The quick brown fox jumps over the lazy dog 0123456789\n";
+
+static void benchconsoles() { // (what krnlMain does)
+    for (size_t i = 0; i < NCONSOLES; i++) {
+        consoles[i].color = VGCOL;
+        consoles[i].vgabase = i * CONROWS;
+        con = &consoles[i];
+        clrscr();
+    }
+    con = fgcon;
+}
+
+static void wlputs() { // a line at a time, on the screen after every line
+    for (uint32_t i = 0; i < 200000; i++) {
+        opstart();
+        puts(benchline);
+        opend();
+        benchbytes += sizeof(benchline) - 1;
+    }
+}
+
+static void wlputchr() { // a character at a time, flushed at the end of the line
+    for (uint32_t i = 0; i < 200000; i++) {
+        for (size_t j = 0; j < sizeof(benchline) - 1; j++) {
+            opstart();
+            putchr(benchline[j]);
+            opend();
+        }
+        flush();
+        benchbytes += sizeof(benchline) - 1;
+    }
+}
+
+static void wlbulk() { // 4KB of text in one console_write (a file being dumped, say)
+    static char text[4096];
+    for (size_t i = 0; i < sizeof(text); i++) {
+        text[i] = benchline[i % (sizeof(benchline) - 1)];
+    }
+    for (uint32_t i = 0; i < 20000; i++) {
+        opstart();
+        console_write(text, sizeof(text));
+        flush();
+        opend();
+        benchbytes += sizeof(text);
+    }
+}
+
+static void wlswitch() { // a line on every console, switching to each one
+    for (uint32_t i = 0; i < 100000; i++) {
+        size_t n = i % NCONSOLES;
+        opstart();
+        con = &consoles[n];
+        puts(benchline);
+        conswitch(n);
+        opend();
+        benchbytes += sizeof(benchline) - 1;
+    }
+}
+
+static void wlscrollback() { // Shift+PgUp, Shift+PgDn (redraws the whole screen each time)
+    for (uint32_t i = 0; i < VGAHI * 4; i++) {
+        puts(benchline);
+    }
+    for (uint32_t i = 0; i < 100000; i++) {
+        opstart();
+        sbscroll(i & 1 ? -VGAHI : VGAHI);
+        opend();
+        benchbytes += VGAHI * VGAWID;
+    }
+}
+
+static void wlclrscr() {
+    for (uint32_t i = 0; i < 100000; i++) {
+        opstart();
+        clrscr();
+        opend();
+        benchbytes += VGAHI * VGAWID;
+    }
+}
+
+/* Runs one benchmark in a child process and prints its line of the table */
+static void benchrun(const char* name, void (*fn)(), int alloc) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid) {
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            printf("%-12s failed\n", name);
+        }
+        return;
+    }
+
+    sseinit();
+    benchmem();
+    if (!alloc) {
+        benchconsoles();
+    }
+    seed = 2463534242u;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t c0 = rdtsc();
+    fn();
+    uint64_t c1 = rdtsc();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double nspertick = secs * 1e9 / (double)(c1 - c0); // (the TSC's speed, worked out from how long the run took)
+    qsort(lat, nlat, sizeof(lat[0]), latcmp);
+    double p50 = nlat ? lat[nlat / 2] * nspertick : 0, p99 = nlat ? lat[nlat - 1 - nlat / 100] * nspertick : 0;
+    if (alloc) {
+        printf("%-12s %9u %12.0f %8.0f %8.0f %10zuK %10zuK %9zuK %6zu%%\n", name, nops, nops / secs, p50, p99,
+               peaklive / 1024, (size_t)pagespeak * PAGESIZE / 1024, endpages * PAGESIZE / 1024, endfrag);
+    } else {
+        printf("%-12s %9u %12.0f %8.0f %8.0f %10.1f\n", name, nops, nops / secs, p50, p99,
+               benchbytes / secs / (1 << 20));
+    }
+    fflush(stdout);
+    exit(0);
+}
+
+/* The self-test: not how fast, but whether it's right, in the corners the benchmarks never go near - 0 bytes, sizes
+   nothing could hold, alignment, realloc across slabs, heap and pages, and freed heap blocks merging with their
+   neighbours. Each test runs in its own child like the benchmarks, with a time limit, since an allocator that never
+   comes back is wrong too. */
+#define TESTSECS 10
+#define TESTOPS 200000
+#define FORMATCASES 3000000
+#define CHECK(x) testcheck((x), #x, __LINE__)
+
+static uint32_t testfailed;
+
+static void testcheck(int ok, const char* what, int line) {
+    if (!ok && testfailed++ < 20) { // (one bug can fail the same check thousands of times)
+        printf("  line %d: %s\n", line, what);
+    }
+}
+
+static void pattern(void* p, size_t n, uint32_t tag) { // fills p with bytes that depend on where they are and on tag...
+    for (size_t i = 0; i < n; i++) {
+        ((uint8_t*)p)[i] = (uint8_t)(i * 7 + tag);
+    }
+}
+
+static int patternok(void* p, size_t n, uint32_t tag) { // ...so anyone writing over it (or a copy that misses) shows
+    for (size_t i = 0; i < n; i++) {
+        if (((uint8_t*)p)[i] != (uint8_t)(i * 7 + tag)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int heapempty() { // is every heap pool back to the single free block it started as?
+    size_t bytes = 0;
+    for (size_t fl = 0; fl < FLCOUNT; fl++) {
+        for (size_t sl = 0; sl < SLCOUNT; sl++) {
+            for (block_header_t* b = heap.lists[fl][sl]; b; b = b->next) {
+                if (BLOCKSIZE(nextphys(b))) { // (only the 0 byte block at the end of the pool may follow it)
+                    return 0;
+                }
+                bytes += sizeof(block_header_t) + BLOCKSIZE(b) + sizeof(block_header_t);
+            }
+        }
+    }
+    return bytes == heap.total;
+}
+
+static void tzero() {
+    free(malloc(0)); // (whatever malloc(0) gives back, free has to take)
+    free(calloc(0, 16));
+    free(calloc(16, 0));
+    free(NULL);
+    void* p = malloc(100);
+    CHECK(realloc(p, 0) == NULL); // (which frees it)
+    p = realloc(NULL, 100); // (which is malloc)
+    CHECK(p && blocksize(p) >= 100);
+    free(p);
+    CHECK(aligned_alloc(0, 16) == NULL); // alignments have to be powers of two
+    CHECK(aligned_alloc(48, 16) == NULL);
+    CHECK(heapempty());
+}
+
+static void thuge() { // sizes nothing could hold: NULL, and nothing else changes
+    size_t most = (size_t)PAGESIZE << MAXORDER; // the biggest block there is
+    size_t sizes[] = { most + 1, (size_t)3 << 30, (size_t)-1 / 2, (size_t)-1 - HEAPALIGN, (size_t)-1 };
+    size_t keepsizes[] = { 100, 3000, BIGALLOC }; // one from a slab, one from the heap, one of whole pages
+    void* keep[3];
+    for (uint32_t k = 0; k < 3; k++) {
+        keep[k] = malloc(keepsizes[k]);
+        pattern(keep[k], keepsizes[k], k);
+    }
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        CHECK(malloc(sizes[i]) == NULL);
+        CHECK(calloc(1, sizes[i]) == NULL);
+        CHECK(calloc(sizes[i], 1) == NULL);
+        CHECK(aligned_alloc(64, sizes[i]) == NULL);
+        CHECK(aligned_alloc(PAGESIZE, sizes[i]) == NULL);
+        for (uint32_t k = 0; k < 3; k++) {
+            CHECK(realloc(keep[k], sizes[i]) == NULL); // (and keep[k] stays as it was)
+        }
+    }
+    size_t half = (size_t)1 << (sizeof(size_t) * 4);
+    CHECK(calloc(half, half) == NULL); // count * size comes out as 0
+    CHECK(aligned_alloc(most * 2, 16) == NULL);
+
+    for (uint32_t k = 0; k < 3; k++) {
+        CHECK(blocksize(keep[k]) >= keepsizes[k] && patternok(keep[k], keepsizes[k], k));
+        free(keep[k]);
+    }
+    CHECK(heapempty());
+    void* p = malloc(most); // (but the biggest block there is still works)
+    CHECK(p != NULL);
+    free(p);
+}
+
+static void tmerge() { // boundary tags: a freed heap block merges with a free block on either side of it
+    free(malloc(3000)); // (so the heap has its first pool already)
+    uint8_t* p[4];
+    block_header_t* h[4];
+    for (uint32_t i = 0; i < 4; i++) {
+        p[i] = malloc(3000);
+        h[i] = (block_header_t*)p[i] - 1;
+    }
+    CHECK(nextphys(h[0]) == h[1] && nextphys(h[1]) == h[2] && nextphys(h[2]) == h[3]); // (a fresh pool goes in order)
+    uint32_t nfree = heap.nfreeblocks; // (the rest of the pool, after p[3])
+
+    free(p[1]); // used on both sides: a free block of its own
+    CHECK(heap.nfreeblocks == nfree + 1);
+    free(p[0]); // merges with p[1], after it
+    CHECK(heap.nfreeblocks == nfree + 1);
+    CHECK(BLOCKSIZE(h[0]) == (size_t)((uint8_t*)h[2] - p[0]));
+    free(p[2]); // merges with p[0] + p[1], before it
+    CHECK(heap.nfreeblocks == nfree + 1);
+    CHECK(BLOCKSIZE(h[0]) == (size_t)((uint8_t*)h[3] - p[0]));
+    CHECK(heaplargest(NULL) >= BLOCKSIZE(h[0]));
+    free(p[3]); // merges both ways: with p[0..2] and the rest of the pool
+    CHECK(heap.nfreeblocks == nfree);
+    CHECK(heapempty());
+}
+
+static void talign() {
+    void* p[8];
+    for (size_t align = 8; align <= 16 * PAGESIZE; align *= 2) {
+        size_t sizes[8] = { 1, 24, align - 1, align, align + 1, 3000, 3 * PAGESIZE, BIGALLOC + 1 };
+        for (uint32_t i = 0; i < 8; i++) {
+            p[i] = aligned_alloc(align, sizes[i]);
+            CHECK(p[i] && ((size_t)p[i] & (align - 1)) == 0 && blocksize(p[i]) >= sizes[i]);
+            if (p[i]) {
+                pattern(p[i], sizes[i], i);
+            }
+        }
+        for (uint32_t i = 0; i < 8; i++) { // (all still there: none of them overlap)
+            CHECK(!p[i] || patternok(p[i], sizes[i], i));
+            free(p[i]);
+        }
+    }
+    for (size_t size = 1; size <= 2 * PAGESIZE; size++) { // and plain malloc is "naturally aligned" (see malloc)
+        void* q = malloc(size);
+        CHECK(q && (size_t)q % (size <= 8 ? 8 : HEAPALIGN) == 0 && blocksize(q) >= size);
+        free(q);
+    }
+    CHECK(heapempty());
+}
+
+static void trealloc() {
+    /* Growing and shrinking through slabs, the heap and whole pages keeps what was in there */
+    size_t sizes[] = { 1, 8, 100, SLABMAX, SLABMAX + 1, 3000, 5000, BIGALLOC - 1, BIGALLOC, 3 * BIGALLOC, 100000,
+                       3000, 100, 8, 1 };
+    uint8_t* p = NULL;
+    size_t have = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint8_t* n = realloc(p, sizes[i]);
+        CHECK(n && blocksize(n) >= sizes[i]);
+        if (!n) {
+            return;
+        }
+        CHECK(patternok(n, have < sizes[i] ? have : sizes[i], 5));
+        pattern(n, sizes[i], 5);
+        p = n;
+        have = sizes[i];
+    }
+    free(p);
+
+    /* A heap block with a free block after it grows where it is, and shrinking one never moves it */
+    uint8_t* a = malloc(3000);
+    uint8_t* b = malloc(3000);
+    uint8_t* c = malloc(3000); // (so b is free on its own once it's freed)
+    free(b);
+    CHECK(realloc(a, 5000) == a);
+    CHECK(realloc(a, 2500) == a);
+    free(a);
+    free(c);
+    CHECK(heapempty());
+}
+
+static void trandom() { // lots of random malloc/calloc/aligned_alloc/realloc/free, and nobody's memory gets trampled
+    for (uint32_t ops = 0; ops < TESTOPS; ops++) {
+        uint32_t i = rnd() % ALLOCSLOTS;
+        if (slots[i]) {
+            CHECK(patternok(slots[i], slotsize[i], i));
+            if (rnd() % 4) {
+                free(slots[i]);
+                slots[i] = NULL;
+                continue;
+            }
+            size_t size = ((size_t)1 << rnd() % 16) + rnd() % 64;
+            uint8_t* n = realloc(slots[i], size);
+            CHECK(n && blocksize(n) >= size);
+            if (n) {
+                CHECK(patternok(n, slotsize[i] < size ? slotsize[i] : size, i));
+                pattern(n, size, i);
+                slots[i] = n;
+                slotsize[i] = size;
+            }
+            continue;
+        }
+
+        size_t size = (size_t)1 << rnd() % 16;
+        size += rnd() % size;
+        uint32_t how = rnd() % 3;
+        if (how == 0) {
+            slots[i] = malloc(size);
+        } else if (how == 1) {
+            slots[i] = calloc(1, size);
+            for (size_t j = 0; slots[i] && j < size; j++) {
+                CHECK(((uint8_t*)slots[i])[j] == 0);
+            }
+        } else {
+            size_t align = (size_t)8 << rnd() % 10;
+            slots[i] = aligned_alloc(align, size);
+            CHECK(((size_t)slots[i] & (align - 1)) == 0);
+        }
+        CHECK(slots[i] && blocksize(slots[i]) >= size);
+        if (slots[i]) {
+            pattern(slots[i], size, i);
+            slotsize[i] = size;
+        }
+    }
+    for (uint32_t i = 0; i < ALLOCSLOTS; i++) {
+        if (slots[i]) {
+            CHECK(patternok(slots[i], slotsize[i], i));
+            free(slots[i]);
+        }
+    }
+    CHECK(heapempty());
+}
+
+static void tformat() { // ksnprintf against the C library's snprintf: random numbers, and buffers that are too small
+    static const char* const fmts[] = { "%d", "%5d", "%-5d|", "%05d", "%u", "%08x", "%X", "%-8x|", "%ld", "%lu", "%zu",
+                                        "%s", "%10s|", "%-10s|", "%c%c", "x%%y", "%3c|", "ab %d cd %u ef %x gh" };
+    char a[64], b[64];
+    for (uint32_t i = 0; i < FORMATCASES; i++) {
+        uint32_t f = rnd() % (sizeof(fmts) / sizeof(fmts[0]));
+        int v = (int)rnd() >> rnd() % 32; // (all sizes of number, both signs)
+        uint32_t u = rnd() >> rnd() % 32;
+        size_t n = rnd() % 2 ? sizeof(a) : rnd() % 8; // (half the time it won't fit)
+        size_t r1;
+        int r2;
+        if (f < 4) {
+            r1 = ksnprintf(a, n, fmts[f], v);
+            r2 = snprintf(b, n, fmts[f], v);
+        } else if (f < 8) {
+            r1 = ksnprintf(a, n, fmts[f], u);
+            r2 = snprintf(b, n, fmts[f], u);
+        } else if (f == 8) {
+            r1 = ksnprintf(a, n, fmts[f], v * 12345678L);
+            r2 = snprintf(b, n, fmts[f], v * 12345678L);
+        } else if (f < 11) {
+            r1 = ksnprintf(a, n, fmts[f], u * 99999999ul);
+            r2 = snprintf(b, n, fmts[f], u * 99999999ul);
+        } else if (f < 14) {
+            r1 = ksnprintf(a, n, fmts[f], "hello");
+            r2 = snprintf(b, n, fmts[f], "hello");
+        } else if (f == 14) {
+            r1 = ksnprintf(a, n, fmts[f], 'q', 'r');
+            r2 = snprintf(b, n, fmts[f], 'q', 'r');
+        } else if (f == 15) {
+            r1 = ksnprintf(a, n, fmts[f]);
+            r2 = snprintf(b, n, fmts[f]);
+        } else if (f == 16) {
+            r1 = ksnprintf(a, n, fmts[f], 'z');
+            r2 = snprintf(b, n, fmts[f], 'z');
+        } else {
+            r1 = ksnprintf(a, n, fmts[f], v, u, u);
+            r2 = snprintf(b, n, fmts[f], v, u, u);
+        }
+        CHECK(r1 == (size_t)r2 && (!n || strcmp(a, b) == 0));
+    }
+
+    /* Where there's no C library to agree with: what isn't a directive comes out as it is */
+    const char* odd = "%q %5q| 100%";
+    CHECK(ksnprintf(a, sizeof(a), odd) == strlen(odd) && strcmp(a, odd) == 0);
+    CHECK(ksnprintf(a, sizeof(a), "%p", (void*)0x1234) == 2 + sizeof(void*) * 2);
+}
+
+/* Runs one test in a child process, and says how it went */
+static int testrun(const char* name, void (*fn)()) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid) {
+        int status;
+        waitpid(pid, &status, 0);
+        int ok = WIFEXITED(status) && !WEXITSTATUS(status);
+        printf("%-12s %s\n", name, ok ? "ok" : WIFEXITED(status) ? "FAILED" : "FAILED (crashed or hung)");
+        return !ok;
+    }
+
+    alarm(TESTSECS);
+    sseinit();
+    benchmem();
+    seed = 2463534242u;
+    fn();
+    fflush(stdout);
+    exit(testfailed != 0);
+}
+
+int main(int argc, char** argv) {
+    const char* what = argc > 1 ? argv[1] : "all";
+    int all = kstrcmp(what, "all") == 0;
+    if ((kstrcmp(what, "replay") == 0) != (argc == 3) || (!all && kstrcmp(what, "alloc") && kstrcmp(what, "replay") &&
+                                                          kstrcmp(what, "console") && kstrcmp(what, "test"))) {
+        fprintf(stderr, "usage: %s [all | alloc | replay <trace dump> | console | test]\n", argv[0]);
+        return 1;
+    }
+
+    if (kstrcmp(what, "test") == 0) {
+        int failed = testrun("zero", tzero) + testrun("huge", thuge) + testrun("merge", tmerge) +
+                     testrun("align", talign) + testrun("realloc", trealloc) + testrun("random", trandom) +
+                     testrun("format", tformat);
+        return failed != 0;
+    }
+
+    if (all || kstrcmp(what, "alloc") == 0 || kstrcmp(what, "replay") == 0) {
+        printf("%-12s %9s %12s %8s %8s %11s %11s %10s %7s\n", "allocator", "ops", "ops/sec", "p50 ns", "p99 ns",
+               "peak live", "peak pages", "end pages", "frag");
+        if (argc == 3) {
+            replayfile = argv[2];
+            benchrun("replay", wlreplay, 1);
+        } else {
+            benchrun("lifo", wllifo, 1);
+            benchrun("small", wlsmall, 1);
+            benchrun("mixed", wlmixed, 1);
+            benchrun("realloc", wlrealloc, 1);
+        }
+    }
+    if (all || kstrcmp(what, "console") == 0) {
+        printf("%s%-12s %9s %12s %8s %8s %10s\n", all ? "\n" : "", "console", "calls", "calls/sec", "p50 ns",
+               "p99 ns", "MB/sec");
+        benchrun("puts", wlputs, 0);
+        benchrun("putchr", wlputchr, 0);
+        benchrun("bulk 4K", wlbulk, 0);
+        benchrun("switch", wlswitch, 0);
+        benchrun("scrollback", wlscrollback, 0);
+        benchrun("clrscr", wlclrscr, 0);
+    }
+    return 0;
 }
+#endif